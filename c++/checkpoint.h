@@ -0,0 +1,120 @@
+// Incremental counting over an append-only input file. The running counts
+// over the whole records processed so far are stored next to the input as
+// "<input>.checkpoint", along with the byte offset reached and the partial
+// record at the end, so a later run only reads and counts the appended bytes.
+// The input must only ever be appended to. Resuming checks that it is the same
+// file (device and inode), that it is not shorter than the offset and that the
+// 4 KiB just before the offset are unchanged, and otherwise counts from
+// scratch, but it does not reread the rest of the processed bytes: an edit
+// further back goes unnoticed.
+
+#pragma once
+
+#include "snapshot.h"
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <type_traits>
+
+template <typename Counts>
+struct incremental_result {
+    Counts counts;
+    std::uint64_t resumed_at = 0;  // offset the checkpoint was valid up to, 0 without one
+    std::uint64_t bytes_read = 0;
+};
+
+namespace checkpoint_detail {
+
+// Bytes of the file hashed to recognize it when resuming
+constexpr std::size_t anchor_size = 4096;
+
+inline std::string read_range(int fd, std::uint64_t begin, std::uint64_t end)
+{
+    std::string bytes(end - begin, '\0');
+    std::size_t done = 0;
+    while (done < bytes.size()) {
+        auto n = ::pread(fd, bytes.data() + done, bytes.size() - done, begin + done);
+        if (n <= 0)
+            break;
+        done += n;
+    }
+    bytes.resize(done);
+    return bytes;
+}
+
+inline std::uint64_t anchor_hash(int fd, std::uint64_t offset)
+{
+    auto bytes = read_range(fd, offset - std::min<std::uint64_t>(offset, anchor_size), offset);
+    return content_hash(bytes.data(), bytes.size());
+}
+
+}
+
+// Counts the records of the file at input_path, each ending with the
+// separator except possibly the last one, resuming from the checkpoint of the
+// same solver (tag) if the file has only grown since. count(text) counts the
+// records of a text of whole records, and add combines counts.
+template <typename Counts, typename Count, typename Add>
+incremental_result<Counts> count_incrementally(std::string const & input_path, std::string_view tag, std::string_view separator,
+        Count count, Add add)
+{
+    static_assert(std::is_trivially_copyable_v<Counts>);
+    using namespace checkpoint_detail;
+    incremental_result<Counts> result {};
+    auto fd = ::open(input_path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return result;
+    struct stat st {};
+    std::uint64_t file_size = ::fstat(fd, &st) == 0 ? st.st_size : 0;
+    std::uint64_t const device = st.st_dev;
+    std::uint64_t const inode = st.st_ino;
+
+    auto checkpoint_path = input_path + ".checkpoint";
+    auto tag_hash = content_hash(tag.data(), tag.size());
+    Counts counts {};
+    std::string text;  // partial record from the checkpoint, then the appended bytes
+    mapped_file checkpoint(checkpoint_path);
+    if (auto snapshot = read_snapshot(checkpoint); snapshot && snapshot->first.content_hash == tag_hash) {
+        snapshot_reader reader(snapshot->second.data(), snapshot->second.size());
+        auto saved_device = reader.read<std::uint64_t>();
+        auto saved_inode = reader.read<std::uint64_t>();
+        auto offset = reader.read<std::uint64_t>();
+        auto anchor = reader.read<std::uint64_t>();
+        auto saved_counts = reader.read<Counts>();
+        auto partial = reader.read_string();
+        if (reader.ok() && saved_device == device && saved_inode == inode && offset <= file_size && partial.size() <= offset
+                && anchor == anchor_hash(fd, offset)) {
+            result.resumed_at = offset;
+            counts = saved_counts;
+            text = partial;
+        }
+    }
+    auto appended = read_range(fd, result.resumed_at, file_size);
+    result.bytes_read = appended.size();
+    text += appended;
+    file_size = result.resumed_at + appended.size();
+
+    auto last = text.rfind(separator);
+    auto whole = last == std::string::npos ? 0 : last + separator.size();
+    std::string_view const view { text };
+    counts = add(counts, count(view.substr(0, whole)));
+
+    snapshot_writer writer;
+    writer.write(device);
+    writer.write(inode);
+    writer.write(file_size);
+    writer.write(anchor_hash(fd, file_size));
+    writer.write(counts);
+    writer.write_string(view.substr(whole));
+    writer.save(checkpoint_path, file_stamp {}, tag_hash);
+    ::close(fd);
+
+    // The partial record counts as a whole one until more is appended
+    result.counts = add(counts, count(view.substr(whole)));
+    return result;
+}
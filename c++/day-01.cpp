@@ -1,22 +1,36 @@
 // https://adventofcode.com/2020/day/1
 
+#include "engine.h"
+#include "flat_hash.h"
+#include "options.h"
+#include "perf_counters.h"
+#include "thread_pool.h"
+#include "timing.h"
 #include <fmt/os.h>
 #include <gsl/span>
+#include <algorithm>
 #include <array>
+#include <atomic>
 #include <cassert>
+#include <chrono>
+#include <cstdint>
 #include <fstream>
+#include <functional>
 #include <iterator>
 #include <optional>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <string_view>
 #include <tuple>
-#include <unordered_set>
 #include <vector>
 
 std::optional<std::tuple<int, int>> find_addend_pair(gsl::span<const int> numbers, int sum)
 {
-    std::unordered_set<int> seen;
+    flat_hash_set<int> seen(numbers.size());
     for (auto a: numbers) {
         auto i = sum - a;
-        if (seen.count(i))
+        if (seen.contains(i))
             return std::tuple { i, a };
         else
             seen.insert(a);
@@ -24,13 +38,124 @@ std::optional<std::tuple<int, int>> find_addend_pair(gsl::span<const int> number
     return std::nullopt;
 }
 
-std::optional<std::tuple<int, int, int>> find_addend_triple(gsl::span<const int> numbers, int sum)
+// Tries the first addends in parallel chunks; chunks starting beyond the
+// first addend found are skipped, and the result is the one with the lowest
+// first addend index, as if searched sequentially
+std::optional<std::tuple<int, int, int>> find_addend_triple(gsl::span<const int> numbers, int sum, thread_pool & pool = shared_pool())
 {
+    using triple = std::optional<std::tuple<int, int, int>>;
     assert(numbers.size() >= 3);
-    for (std::size_t i = 0; i < numbers.size() - 2; ++i)
-        if (auto p = find_addend_pair(numbers.subspan(i + 1), sum - numbers[i]); p)
-            return std::tuple { numbers[i], std::get<0>(*p), std::get<1>(*p) };
-    return std::nullopt;
+    std::atomic<std::size_t> found_at { numbers.size() };
+    return parallel_reduce(pool, 0, numbers.size() - 2, 16, triple {}, [&] (std::size_t begin, std::size_t end) -> triple {
+        for (auto i = begin; i < end && i < found_at; ++i)
+            if (auto p = find_addend_pair(numbers.subspan(i + 1), sum - numbers[i]); p) {
+                fetch_min(found_at, i);
+                return std::tuple { numbers[i], std::get<0>(*p), std::get<1>(*p) };
+            }
+        return std::nullopt;
+    }, [] (triple lhs, triple rhs) { return lhs ? lhs : rhs; });
+}
+
+// Expense list indexed once for answering many pair sum queries: the sorted
+// values, plus bit sets of the values present and the values present at least
+// twice if the value range is small enough
+struct expense_index {
+public:
+    explicit expense_index(gsl::span<const int> numbers)
+        : sorted(numbers.begin(), numbers.end())
+    {
+        std::sort(sorted.begin(), sorted.end());
+        if (sorted.empty())
+            return;
+        min = sorted.front();
+        auto range = static_cast<std::uint64_t>(std::int64_t { sorted.back() } - min) + 1;
+        if (range > std::max<std::uint64_t>(std::uint64_t { 1 } << 20, 64 * sorted.size()))
+            return;
+        present.resize((range + 63) / 64);
+        twice.resize(present.size());
+        for (auto v: sorted) {
+            auto bit = static_cast<std::uint64_t>(std::int64_t { v } - min);
+            if (test(present, bit))
+                twice[bit / 64] |= std::uint64_t { 1 } << (bit % 64);
+            present[bit / 64] |= std::uint64_t { 1 } << (bit % 64);
+        }
+    }
+
+    std::optional<std::tuple<int, int>> find_addend_pair(int sum) const
+    {
+        for (auto a: sorted) {
+            auto b = std::int64_t { sum } - a;
+            if (b < a)
+                break;
+            if (b == a ? occurs_twice(a) : contains(b))
+                return std::tuple { a, static_cast<int>(b) };
+        }
+        return std::nullopt;
+    }
+
+private:
+    static bool test(std::vector<std::uint64_t> const & bits, std::uint64_t bit)
+    {
+        return (bits[bit / 64] >> (bit % 64) & 1) != 0;
+    }
+
+    bool contains(std::int64_t v) const
+    {
+        if (v < sorted.front() || v > sorted.back())
+            return false;
+        if (!present.empty())
+            return test(present, static_cast<std::uint64_t>(v - min));
+        return std::binary_search(sorted.begin(), sorted.end(), v);
+    }
+
+    bool occurs_twice(int v) const
+    {
+        if (!present.empty())
+            return test(twice, static_cast<std::uint64_t>(std::int64_t { v } - min));
+        return std::upper_bound(sorted.begin(), sorted.end(), v) - std::lower_bound(sorted.begin(), sorted.end(), v) >= 2;
+    }
+
+    std::vector<int> sorted;
+    int min = 0;
+    std::vector<std::uint64_t> present;
+    std::vector<std::uint64_t> twice;
+};
+
+// Answers the queries in parallel
+std::vector<std::optional<std::tuple<int, int>>> find_addend_pairs(expense_index const & index, gsl::span<const int> sums, thread_pool & pool = shared_pool())
+{
+    std::vector<std::optional<std::tuple<int, int>>> pairs(sums.size());
+    pool.parallel_for(0, sums.size(), 256, [&] (std::size_t begin, std::size_t end) {
+        for (auto i = begin; i < end; ++i)
+            pairs[i] = index.find_addend_pair(sums[i]);
+    });
+    return pairs;
+}
+
+void benchmark(gsl::span<const int> numbers, std::size_t n_queries)
+{
+    assert(!numbers.empty());
+    std::mt19937 gen;
+    std::uniform_int_distribution<int> sum_dist(0, 2 * *std::max_element(numbers.begin(), numbers.end()));
+    std::vector<int> sums(n_queries);
+    std::generate(sums.begin(), sums.end(), [&] { return sum_dist(gen); });
+
+    auto start = std::chrono::steady_clock::now();
+    std::size_t n_found = 0;
+    for (auto sum: sums)
+        if (find_addend_pair(numbers, sum))
+            ++n_found;
+    auto per_query_time = seconds_since(start);
+
+    start = std::chrono::steady_clock::now();
+    expense_index index(numbers);
+    auto pairs = find_addend_pairs(index, sums);
+    auto batch_time = seconds_since(start);
+    assert(static_cast<std::size_t>(std::count_if(pairs.begin(), pairs.end(), [] (auto const & p) { return p.has_value(); })) == n_found);
+
+    fmt::print("Queries: {}, with a pair: {}\n", n_queries, n_found);
+    fmt::print("Per query hash set: {:.3e} queries/s\n", n_queries / per_query_time);
+    fmt::print("Batch on index ({} threads): {:.3e} queries/s\n", shared_pool().size(), n_queries / batch_time);
 }
 
 void test()
@@ -42,20 +167,82 @@ void test()
 
     auto t = find_addend_triple(numbers, 2020);
     assert(std::get<0>(t.value()) * std::get<1>(t.value()) * std::get<2>(t.value()) == 241861950);
+    thread_pool pool(3);
+    std::vector<int> many_numbers(1000, 1);
+    many_numbers[900] = 500;
+    many_numbers[950] = 700;
+    assert(find_addend_triple(many_numbers, 1201, pool) == std::tuple(1, 500, 700));
+    assert(!find_addend_triple(many_numbers, 1202, pool));
+    // A throwing chunk neither stalls the others nor is lost
+    std::atomic<std::size_t> n_visited { 0 };
+    bool rethrown = false;
+    try {
+        pool.parallel_for(0, 1000, 10, [&] (std::size_t begin, std::size_t end) {
+            n_visited += end - begin;
+            if (begin == 0)
+                throw std::runtime_error("first chunk");
+        });
+    } catch (std::runtime_error const & e) {
+        rethrown = std::string_view { e.what() } == "first chunk";
+    }
+    assert(rethrown && n_visited == 1000);
+    rethrown = false;
+    try {
+        parallel_reduce(pool, 0, 1000, 10, 0, [] (std::size_t begin, std::size_t) -> int {
+            if (begin > 0)
+                throw std::out_of_range("later chunk");
+            return 1;
+        }, std::plus<> {});
+    } catch (std::out_of_range const &) {
+        rethrown = true;
+    }
+    assert(rethrown);
+
+    expense_index index(numbers);
+    auto pairs = find_addend_pairs(index, std::array { 2020, 2, 1041, 3177, 4000 }, pool);
+    assert(pairs[0] == std::tuple(299, 1721));
+    assert(!pairs[1] && !pairs[4]);
+    assert(pairs[2] == std::tuple(366, 675));
+    assert(pairs[3] == std::tuple(1456, 1721));
+    assert(expense_index(std::array { 5, 1000000000, 5 }).find_addend_pair(10) == std::tuple(5, 5));
+    assert(!expense_index(std::array { 5, 1000000000 }).find_addend_pair(10));
+    assert(expense_index(std::array { -2000000000, 2000000000 }).find_addend_pair(0) == std::tuple(-2000000000, 2000000000));
 }
 
-int main()
+int main(int argc, char * argv[])
 {
     test();
 
-    std::ifstream in("input/day-01");
-    std::vector<int> const expenses {
-            std::istream_iterator<int>(in),
-	        std::istream_iterator<int>() };
+    options opts(argc, argv);
+    perf_report perf(opts);
+    configure_shared_pool(opts);
+    engine_selector engines(opts);
+    auto const expenses = perf.measure("parse", [&] {
+        std::ifstream in(std::string { opts.value_or("--input", "input/day-01") });
+        return std::vector<int> {
+                std::istream_iterator<int>(in),
+                std::istream_iterator<int>() };
+    });
+
+    if (auto n_queries = opts.value("--benchmark")) {
+        benchmark(expenses, std::stoul(std::string { *n_queries }));
+        return 0;
+    }
 
-    auto p = find_addend_pair(expenses, 2020);
-    fmt::print("Product of pair: {}\n", std::get<0>(p.value()) * std::get<1>(p.value()));
+    // Engines may find the addends in a different order, so compare the products
+    auto pair_product = [] (auto p) { return std::get<0>(p.value()) * std::get<1>(p.value()); };
+    auto p = perf.measure("part 1", [&] {
+        return engines.run("part 1", expenses.size(), 1 << 12,
+                [&] { return pair_product(find_addend_pair(expenses, 2020)); },
+                [&] { return pair_product(expense_index(expenses).find_addend_pair(2020)); });
+    });
+    fmt::print("Product of pair: {}\n", p);
 
-    auto t = find_addend_triple(expenses, 2020);
-    fmt::print("Product of triple: {}\n", std::get<0>(t.value()) * std::get<1>(t.value()) * std::get<2>(t.value()));
+    auto triple_product = [] (auto t) { return std::get<0>(t.value()) * std::get<1>(t.value()) * std::get<2>(t.value()); };
+    auto t = perf.measure("part 2", [&] {
+        return engines.run("part 2", expenses.size(), 1 << 10,
+                [&] { return triple_product(find_addend_triple(expenses, 2020, sequential_pool())); },
+                [&] { return triple_product(find_addend_triple(expenses, 2020)); });
+    });
+    fmt::print("Product of triple: {}\n", t);
 }
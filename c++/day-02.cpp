@@ -1,10 +1,27 @@
 // https://adventofcode.com/2020/day/2
 
+#include "checkpoint.h"
+#include "engine.h"
+#include "options.h"
+#include "perf_counters.h"
+#include "pipe_reader.h"
+#include "snapshot.h"
+#include "thread_pool.h"
+#include <fcntl.h>
+#include <unistd.h>
 #include <fmt/os.h>
 #include <algorithm>
+#include <array>
 #include <cassert>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <fstream>
+#include <functional>
 #include <iterator>
+#include <optional>
 #include <regex>
 #include <string>
 #include <string_view>
@@ -24,58 +41,308 @@ struct pw_entry {
     std::string pw;
 };
 
-bool check(pw_entry const & e, pw_policy::occurence_rule)
+bool check(pw_policy const & policy, std::string_view pw, pw_policy::occurence_rule)
 {
-    auto count = std::count(e.pw.begin(), e.pw.end(), e.policy.c);
-    return count >= e.policy.a && count <= e.policy.b;
+    auto count = std::count(pw.begin(), pw.end(), policy.c);
+    return count >= policy.a && count <= policy.b;
 }
 
-bool check(pw_entry const & e, pw_policy::position_rule)
+bool check(pw_policy const & policy, std::string_view pw, pw_policy::position_rule)
 {
     auto match_at = [&] (auto pos) {
-        return pos >= 1 && pos <= e.pw.size() && e.pw[pos - 1] == e.policy.c;
+        return pos >= 1 && pos <= pw.size() && pw[pos - 1] == policy.c;
     };
-    return match_at(e.policy.a) != match_at(e.policy.b);  // boolean xor
+    return match_at(policy.a) != match_at(policy.b);  // boolean xor
 }
 
 template <typename Rule>
-auto count_valid(std::vector<pw_entry> const & entries, Rule)
+bool check(pw_entry const & e, Rule rule)
 {
-    return std::count_if(entries.begin(), entries.end(), [] (auto const & e) { return check(e, Rule {}); });
+    return check(e.policy, e.pw, rule);
 }
 
-template <typename It>
-std::vector<pw_entry> read_pw_entries(It begin, It end)
+// Entries in flat arrays where they are stored (e.g. in a snapshot): the
+// password of entry i is chars[pw_offsets[i]..pw_offsets[i + 1])
+struct pw_entries_view {
+    std::size_t size;
+    pw_policy const * policies;
+    std::uint32_t const * pw_offsets;
+    char const * chars;
+
+    std::string_view pw(std::size_t i) const { return { chars + pw_offsets[i], pw_offsets[i + 1] - pw_offsets[i] }; }
+};
+
+template <typename Rule>
+auto count_valid(std::vector<pw_entry> const & entries, Rule, thread_pool & pool = shared_pool())
+{
+    return parallel_reduce(pool, 0, entries.size(), 1024, std::ptrdiff_t { 0 }, [&] (std::size_t begin, std::size_t end) {
+        return std::count_if(entries.begin() + begin, entries.begin() + end, [] (auto const & e) { return check(e, Rule {}); });
+    }, std::plus<> {});
+}
+
+// Counts the entries valid under each of the rules, as one visitor
+template <typename... Rules>
+struct valid_counter {
+    using counts_t = std::array<std::size_t, sizeof...(Rules)>;
+    counts_t counts {};
+
+    void operator()(pw_policy const & policy, std::string_view pw)
+    {
+        std::size_t i = 0;
+        ((counts[i++] += check(policy, pw, Rules {}) ? 1 : 0), ...);
+    }
+
+    void operator()(pw_entry const & e)
+    {
+        (*this)(e.policy, e.pw);
+    }
+
+    static counts_t add(counts_t lhs, counts_t const & rhs)
+    {
+        std::transform(lhs.begin(), lhs.end(), rhs.begin(), lhs.begin(), std::plus<> {});
+        return lhs;
+    }
+};
+
+template <typename... Rules>
+auto count_valid_fused(std::vector<pw_entry> const & entries, thread_pool & pool = shared_pool())
+{
+    using counter = valid_counter<Rules...>;
+    return parallel_reduce(pool, 0, entries.size(), 1024, typename counter::counts_t {}, [&] (std::size_t begin, std::size_t end) {
+        counter c;
+        std::for_each(entries.begin() + begin, entries.begin() + end, std::ref(c));
+        return c.counts;
+    }, counter::add);
+}
+
+template <typename... Rules>
+auto count_valid_fused(pw_entries_view entries, thread_pool & pool = shared_pool())
+{
+    using counter = valid_counter<Rules...>;
+    return parallel_reduce(pool, 0, entries.size, 1024, typename counter::counts_t {}, [&] (std::size_t begin, std::size_t end) {
+        counter c;
+        for (auto i = begin; i < end; ++i)
+            c(entries.policies[i], entries.pw(i));
+        return c.counts;
+    }, counter::add);
+}
+
+template <typename It, typename F>
+void for_each_pw_entry(It begin, It end, F f)
 {
-    std::vector<pw_entry> e;
     std::regex entry_regex { R"((\d+)-(\d+) (.): (\S*))" };
     for (auto it = std::regex_iterator<It> { begin, end, entry_regex }; it != std::regex_iterator<It> {}; ++it) {
         auto const & match = *it;
-        e.push_back({ { std::stoi(match[1]), std::stoi(match[2]), match.str(3)[0] }, match[4] });
+        f(pw_entry { { std::stoi(match[1]), std::stoi(match[2]), match.str(3)[0] }, match[4] });
     }
+}
+
+template <typename It>
+std::vector<pw_entry> read_pw_entries(It begin, It end)
+{
+    std::vector<pw_entry> e;
+    for_each_pw_entry(begin, end, [&] (pw_entry && entry) { e.push_back(std::move(entry)); });
     return e;
 }
 
-void test()
+// Counts the entries valid under each of the rules straight from the input,
+// without materializing the entries, in parallel over chunks of whole lines
+template <typename... Rules>
+auto count_valid_fused(std::string_view input, thread_pool & pool = shared_pool())
+{
+    using counter = valid_counter<Rules...>;
+    auto chunks = split_into_chunks(input, 4 * pool.size(), "\n");
+    return parallel_reduce(pool, 0, chunks.size(), 1, typename counter::counts_t {}, [&] (std::size_t begin, std::size_t end) {
+        counter c;
+        for (auto i = begin; i < end; ++i)
+            for_each_pw_entry(chunks[i].begin(), chunks[i].end(), std::ref(c));
+        return c.counts;
+    }, counter::add);
+}
+
+// Stored as the pw_entries_view arrays, each preceded by its size
+void save_snapshot(snapshot_writer & w, std::vector<pw_entry> const & entries)
+{
+    std::vector<pw_policy> policies;
+    std::vector<std::uint32_t> pw_offsets { 0 };
+    std::string chars;
+    for (auto const & e: entries) {
+        policies.push_back(e.policy);
+        chars += e.pw;
+        pw_offsets.push_back(chars.size());
+    }
+    w.write(std::uint64_t { entries.size() });
+    w.write_array(policies.data(), policies.size());
+    w.write_array(pw_offsets.data(), pw_offsets.size());
+    w.write(std::uint64_t { chars.size() });
+    w.write_array(chars.data(), chars.size());
+}
+
+std::optional<pw_entries_view> load_pw_entries(snapshot_reader & r)
 {
-    constexpr std::string_view input = R"(
+    pw_entries_view entries;
+    entries.size = r.read_size();
+    entries.policies = r.read_array<pw_policy>(entries.size);
+    entries.pw_offsets = r.read_array<std::uint32_t>(entries.size + 1);
+    auto n_chars = r.read_size();
+    entries.chars = r.read_array<char>(n_chars);
+    if (!entries.chars || entries.pw_offsets[0] != 0 || entries.pw_offsets[entries.size] != n_chars
+            || !std::is_sorted(entries.pw_offsets, entries.pw_offsets + entries.size + 1))
+        return std::nullopt;
+    return entries;
+}
+
+constexpr std::string_view example_entries = R"(
             1-3 a: abcde
             1-3 b: cdefg
             2-9 c: ccccccccc)";
-    auto pw_entries = read_pw_entries(input.begin(), input.end());
+
+void test()
+{
+    auto pw_entries = read_pw_entries(example_entries.begin(), example_entries.end());
     assert(count_valid(pw_entries, pw_policy::occurence_rule {}) == 2);
     assert(count_valid(pw_entries, pw_policy::position_rule {}) == 1);
+    using expected_counts = std::array<std::size_t, 2>;
+    assert((count_valid_fused<pw_policy::occurence_rule, pw_policy::position_rule>(pw_entries) == expected_counts { 2, 1 }));
+    thread_pool pool(3);
+    assert((count_valid_fused<pw_policy::position_rule, pw_policy::occurence_rule>(example_entries, pool) == expected_counts { 1, 2 }));
+    assert(count_valid(pw_entries, pw_policy::occurence_rule {}, pool) == 2);
+
+    snapshot_writer w;
+    save_snapshot(w, pw_entries);
+    auto payload = w.release();
+    snapshot_reader r(payload.data(), payload.size());
+    auto entries = load_pw_entries(r);
+    assert(entries && r.ok() && entries->pw(2) == "ccccccccc");
+    assert((count_valid_fused<pw_policy::occurence_rule, pw_policy::position_rule>(*entries, pool) == expected_counts { 2, 1 }));
+}
+
+// Tests that need pipes, threads or files, run by "--self-test" rather than
+// on every run
+void self_test()
+{
+    // Destroying a reader does not wait for input that never comes
+    int fds[2];
+    if (pipe(fds) != 0) {
+        fmt::print(stderr, "Cannot create pipe: {}\n", std::strerror(errno));
+        std::exit(EXIT_FAILURE);
+    }
+    {
+        pipe_reader idle(fds[0]);
+    }
+    close(fds[0]);
+    close(fds[1]);
+
+    // Counting a file resumes from its checkpoint once more is appended
+    std::string const path = "day-02-self-test.input";
+    std::remove((path + ".checkpoint").c_str());
+    auto fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        fmt::print(stderr, "Cannot create {}: {}\n", path, std::strerror(errno));
+        std::exit(EXIT_FAILURE);
+    }
+    using counter = valid_counter<pw_policy::occurence_rule, pw_policy::position_rule>;
+    auto count_file = [&] {
+        return count_incrementally<counter::counts_t>(path, "day-02", "\n", [] (std::string_view text) {
+            return count_valid_fused<pw_policy::occurence_rule, pw_policy::position_rule>(text, sequential_pool());
+        }, counter::add);
+    };
+    auto const split = example_entries.find("c: ");  // within the last line
+    auto written = write(fd, example_entries.data(), split);
+    assert(written == static_cast<ssize_t>(split));
+    auto first = count_file();
+    assert(first.resumed_at == 0 && (first.counts == count_valid_fused<pw_policy::occurence_rule, pw_policy::position_rule>(example_entries.substr(0, split), sequential_pool())));
+    written = write(fd, example_entries.data() + split, example_entries.size() - split);
+    assert(written == static_cast<ssize_t>(example_entries.size() - split));
+    auto second = count_file();
+    assert(second.resumed_at == split && second.bytes_read == example_entries.size() - split);
+    assert((second.counts == counter::counts_t { 2, 1 }));
+    // Rewritten instead of appended to
+    written = pwrite(fd, "2", 1, example_entries.find("1-3"));
+    assert(written == 1);
+    auto third = count_file();
+    assert(third.resumed_at == 0 && (third.counts == counter::counts_t { 1, 0 }));
+    close(fd);
+    std::remove(path.c_str());
+    std::remove((path + ".checkpoint").c_str());
 }
 
-int main()
+int main(int argc, char * argv[])
 {
     test();
 
-    std::ifstream in("input/day-02");
-    std::vector<char> input(std::istreambuf_iterator<char> { in }, std::istreambuf_iterator<char> {});
-    auto pw_entries = read_pw_entries(input.begin(), input.end());
-    fmt::print("Valid passwords (occurrence policy) : {}\n",
-            count_valid(pw_entries, pw_policy::occurence_rule {}));
-    fmt::print("Valid passwords (position policy): {}\n",
-            count_valid(pw_entries, pw_policy::position_rule {}));
+    options opts(argc, argv);
+    if (opts.has("--self-test")) {
+        self_test();
+        return 0;
+    }
+    perf_report perf(opts);
+    configure_shared_pool(opts);
+    engine_selector engines(opts);
+    using counter = valid_counter<pw_policy::occurence_rule, pw_policy::position_rule>;
+    auto count_reference = [] (std::string_view text) {
+        auto entries = read_pw_entries(text.begin(), text.end());
+        return counter::counts_t {
+                static_cast<std::size_t>(count_valid(entries, pw_policy::occurence_rule {}, sequential_pool())),
+                static_cast<std::size_t>(count_valid(entries, pw_policy::position_rule {}, sequential_pool())) };
+    };
+    auto count_fused = [] (std::string_view text) {
+        return count_valid_fused<pw_policy::occurence_rule, pw_policy::position_rule>(text);
+    };
+    std::string const input_path { opts.value_or("--input", "input/day-02") };
+    // Blocks of whole lines are counted while the next ones are being read
+    auto count_piped = [&] {
+        return perf.measure("read+parse+parts 1,2", [&] {
+            counter::counts_t counts {};
+            pipe_reader reader(STDIN_FILENO, opts);
+            reader.for_each_block("\n", [&] (std::string_view block) {
+                counts = counter::add(counts, engines.run("parts 1,2", block.size(), 1 << 12,
+                        [&] { return count_reference(block); }, [&] { return count_fused(block); }));
+            });
+            return counts;
+        });
+    };
+    auto read_input = [&] {
+        std::ifstream in(input_path);
+        return std::vector<char>(std::istreambuf_iterator<char> { in }, std::istreambuf_iterator<char> {});
+    };
+    auto count_file = [&] {
+        auto input = perf.measure("read", read_input);
+        std::string_view const text { input.data(), input.size() };
+        return perf.measure("parse+parts 1,2", [&] {
+            return engines.run("parts 1,2", input.size(), 1 << 12, [&] { return count_reference(text); }, [&] { return count_fused(text); });
+        });
+    };
+    // The snapshot holds the entries in the flat form the fast engine counts,
+    // so with it the fast engine is used whatever the input size
+    auto const snapshot = opts.has("--snapshot");
+    if (snapshot && !engines.use_fast(0, 0) && !engines.verifying())
+        fmt::print(stderr, "--snapshot has no effect with --engine=reference\n");
+    auto count_snapshotted = [&] {
+        auto entries = perf.measure("parse", [&] {
+            return parse_with_snapshot<pw_entries_view>(input_path,
+                    [] (std::string_view text) { return read_pw_entries(text.begin(), text.end()); }, save_snapshot, load_pw_entries);
+        });
+        return perf.measure("parts 1,2", [&] {
+            return engines.run("parts 1,2", entries.view.size, 0, [&] {
+                auto input = read_input();
+                return count_reference({ input.data(), input.size() });
+            }, [&] { return count_valid_fused<pw_policy::occurence_rule, pw_policy::position_rule>(entries.view); });
+        });
+    };
+    // Only the bytes appended since the last run are read and counted
+    auto count_checkpointed = [&] {
+        auto result = perf.measure("read+parse+parts 1,2", [&] {
+            return count_incrementally<counter::counts_t>(input_path, "day-02", "\n", [&] (std::string_view text) {
+                return engines.run("parts 1,2", text.size(), 1 << 12, [&] { return count_reference(text); }, [&] { return count_fused(text); });
+            }, counter::add);
+        });
+        fmt::print(stderr, "Resumed from checkpoint at byte {}, read {} new bytes\n", result.resumed_at, result.bytes_read);
+        return result.counts;
+    };
+    auto [occurence_valid, position_valid] = opts.has("--stdin") ? count_piped()
+            : opts.has("--incremental") ? count_checkpointed()
+            : snapshot && (engines.use_fast(0, 0) || engines.verifying()) ? count_snapshotted() : count_file();
+    fmt::print("Valid passwords (occurrence policy) : {}\n", occurence_valid);
+    fmt::print("Valid passwords (position policy): {}\n", position_valid);
 }
@@ -1,46 +1,47 @@
 // https://adventofcode.com/2020/day/3
 
+#include "engine.h"
+#include "grid_view.h"
+#include "options.h"
+#include "perf_counters.h"
+#include "snapshot.h"
 #include <fmt/os.h>
 #include <algorithm>
 #include <cassert>
 #include <cstdlib>
-#include <fstream>
-#include <iterator>
+#include <functional>
 #include <numeric>
+#include <string>
 #include <string_view>
-#include <utility>
 #include <vector>
 
 struct square { std::size_t x; std::size_t y; };
 
+// The map read in place from the input text
 struct tree_map {
 public:
-    template <typename It>
-    tree_map(It begin, It end)
+    explicit tree_map(std::string_view text)
+        : grid(text)
     {
-        std::vector<bool> row;
-        for (auto it = begin; it != end; ++it) {
-            if (*it == '\n') {
-                rows.push_back(std::move(row));
-                row.clear();
-            }
-            else
-                row.push_back(*it == '#');
+        if (grid.is_empty() || !grid.is_rectangular()) {
+            fmt::print(stderr, "The map is not a non-empty rectangle\n");
+            std::exit(EXIT_FAILURE);
         }
-        auto not_equal_lengths = [] (auto const & lhs, auto const & rhs) { return lhs.size() != rhs.size(); };
-        assert(std::adjacent_find(rows.begin(), rows.end(), not_equal_lengths) == rows.end());
-        assert(!rows.empty() && !rows[0].empty());
     }
 
     bool has_tree(square pos) const
     {
-        return rows[pos.y][pos.x % rows[0].size()];
+        return grid.at(pos.x % grid.n_cols(), pos.y) == '#';
     }
 
-    std::size_t n_rows() const { return rows.size(); }
+    std::size_t n_rows() const { return grid.n_rows(); }
+    std::size_t n_cols() const { return grid.n_cols(); }
+
+    // The trees packed into bits, built on first use
+    grid_view::bit_grid const & trees() const { return grid.packed('#'); }
 
 private:
-    std::vector<std::vector<bool>> rows;
+    grid_view grid;
 };
 
 square follow_slope(square pos, square slope)
@@ -64,6 +65,23 @@ auto tree_count_product(tree_map const & map, square start_pos, std::vector<squa
     });
 }
 
+// Counts the trees encountered for each of the slopes in a single pass over
+// the rows of the bit-packed map
+std::vector<std::size_t> count_trees_fused(tree_map const & map, square start_pos, std::vector<square> const & slopes)
+{
+    auto const & trees = map.trees();
+    std::vector<std::size_t> counts(slopes.size());
+    std::vector<square> positions(slopes.size(), start_pos);
+    for (auto y = start_pos.y; y < map.n_rows(); ++y)
+        for (std::size_t i = 0; i < slopes.size(); ++i)
+            if (positions[i].y == y) {
+                if (trees.test(positions[i].x % map.n_cols(), y))
+                    ++counts[i];
+                positions[i] = follow_slope(positions[i], slopes[i]);
+            }
+    return counts;
+}
+
 void test()
 {
     const std::string_view input =
@@ -78,17 +96,41 @@ void test()
             "#.##...#...\n"
             "#...##....#\n"
             ".#..#...#.#\n";
-    auto map = tree_map(input.begin(), input.end());
+    auto map = tree_map(input);
     assert(count_trees(map, { 0, 0 }, { 3, 1 }) == 7);
     assert(tree_count_product(map, { 0, 0 }, { { 1, 1 }, { 3, 1 }, { 5, 1 }, { 7, 1 }, { 1, 2 } }) == 336);
+    assert(count_trees_fused(map, { 0, 0 }, { { 1, 1 }, { 3, 1 }, { 5, 1 }, { 7, 1 }, { 1, 2 } }) == (std::vector<std::size_t> { 2, 7, 3, 4, 2 }));
+    // Without the last newline, and wider than a word of bits
+    auto const wide_row = std::string(70, '.') + "#";
+    auto const wide_input = wide_row + "\n" + std::string(71, '.') + "\n" + wide_row;
+    auto wide_map = tree_map(wide_input);
+    assert(grid_view { wide_input }.is_rectangular() && !grid_view { wide_input + "\n" }.is_empty());
+    assert(!grid_view { "..#\n.#\n" }.is_rectangular() && grid_view { "" }.is_empty());
+    assert(wide_map.n_rows() == 3 && wide_map.n_cols() == 71);
+    assert(count_trees(wide_map, { 0, 0 }, { 35, 1 }) == 1);
+    assert(count_trees_fused(wide_map, { 0, 0 }, { { 35, 1 }, { 70, 2 }, { 1, 1 } }) == (std::vector<std::size_t> { 1, 1, 0 }));
 }
 
-int main()
+int main(int argc, char * argv[])
 {
     test();
 
-    std::ifstream in("input/day-03");
-    auto map = tree_map(std::istreambuf_iterator<char> { in }, std::istreambuf_iterator<char> {});
-    fmt::print("Trees encountered: {}\n", count_trees(map, { 0, 0 }, { 3, 1 }));
-    fmt::print("Trees encountered product: {}\n", tree_count_product(map, { 0, 0 }, { { 1, 1 }, { 3, 1 }, { 5, 1 }, { 7, 1 }, { 1, 2 } }));
+    options opts(argc, argv);
+    engine_selector engines(opts);
+    perf_report perf(opts);
+    mapped_file const input(std::string { opts.value_or("--input", "input/day-03") });
+    auto map = perf.measure("parse", [&] { return tree_map({ input.data, input.size }); });
+    std::vector<square> const slopes { { 3, 1 }, { 1, 1 }, { 5, 1 }, { 7, 1 }, { 1, 2 } };
+    auto counts = perf.measure("parts 1,2", [&] {
+        return engines.run("parts 1,2", map.n_rows(), 256, [&] {
+            std::vector<std::size_t> counts;
+            for (auto slope: slopes)
+                counts.push_back(count_trees(map, { 0, 0 }, slope));
+            return counts;
+        }, [&] {
+            return count_trees_fused(map, { 0, 0 }, slopes);
+        });
+    });
+    fmt::print("Trees encountered: {}\n", counts[0]);
+    fmt::print("Trees encountered product: {}\n", std::accumulate(counts.begin(), counts.end(), std::size_t { 1 }, std::multiplies<> {}));
 }
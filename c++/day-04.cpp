@@ -1,12 +1,28 @@
 // https://adventofcode.com/2020/day/4
 
+#include "checkpoint.h"
+#include "engine.h"
+#include "options.h"
+#include "perf_counters.h"
+#include "pipe_reader.h"
+#include "snapshot.h"
+#include "thread_pool.h"
+#include <fcntl.h>
+#include <unistd.h>
 #include <fmt/os.h>
 #include <algorithm>
 #include <array>
 #include <cassert>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <fstream>
 #include <functional>
 #include <iterator>
+#include <limits>
+#include <optional>
 #include <regex>
 #include <string>
 #include <string_view>
@@ -15,9 +31,10 @@
 
 using passport = std::unordered_map<std::string, std::string>;
 
+constexpr std::array<std::string_view, 7> required_fields { "byr", "iyr", "eyr", "hgt", "hcl", "ecl", "pid" };
+
 bool is_loosely_valid(passport const & p)
 {
-    static const std::array<std::string_view, 7> required_fields { "byr", "iyr", "eyr", "hgt", "hcl", "ecl", "pid" };
     return std::all_of(required_fields.begin(), required_fields.end(), [&] (auto field) { return p.count(std::string(field)) > 0; });
 }
 
@@ -78,25 +95,210 @@ bool is_strictly_valid(passport const & p)
 }
 
 template <typename Validator>
-auto count_valid(std::vector<passport> const & passports, Validator validator)
+auto count_valid(std::vector<passport> const & passports, Validator validator, thread_pool & pool = shared_pool())
 {
-    return std::count_if(passports.begin(),passports.end(), validator);
+    return parallel_reduce(pool, 0, passports.size(), 64, std::ptrdiff_t { 0 }, [&] (std::size_t begin, std::size_t end) {
+        return std::count_if(passports.begin() + begin, passports.begin() + end, validator);
+    }, std::plus<> {});
 }
 
-template <typename It>
-std::vector<passport> read_passports(It begin, It end)
+// Counts the passports valid according to each of the validators, as one visitor
+template <auto... Validators>
+struct valid_counter {
+    using counts_t = std::array<std::size_t, sizeof...(Validators)>;
+    counts_t counts {};
+
+    void operator()(passport const & p)
+    {
+        std::size_t i = 0;
+        ((counts[i++] += Validators(p) ? 1 : 0), ...);
+    }
+
+    static counts_t add(counts_t lhs, counts_t const & rhs)
+    {
+        std::transform(lhs.begin(), lhs.end(), rhs.begin(), lhs.begin(), std::plus<> {});
+        return lhs;
+    }
+};
+
+template <auto... Validators>
+auto count_valid_fused(std::vector<passport> const & passports, thread_pool & pool = shared_pool())
+{
+    using counter = valid_counter<Validators...>;
+    return parallel_reduce(pool, 0, passports.size(), 64, typename counter::counts_t {}, [&] (std::size_t begin, std::size_t end) {
+        counter c;
+        std::for_each(passports.begin() + begin, passports.begin() + end, std::ref(c));
+        return c.counts;
+    }, counter::add);
+}
+
+template <typename It, typename F>
+void for_each_passport(It begin, It end, F f)
 {
-    std::vector<passport> passports;
     std::regex passport_regex { R"(\n\n)" };
     std::regex kv_regex { R"(([^:\s]+):(\S*))" };
     for (auto it = std::regex_token_iterator<It> { begin, end, passport_regex, -1 }; it != std::regex_token_iterator<It> {}; ++it) {
-        passports.emplace_back();
+        passport p;
         for (auto kv_it = std::regex_iterator<It> { it->first, it->second, kv_regex }; kv_it != std::regex_iterator<It> {}; ++kv_it)
-            passports.back().emplace((*kv_it)[1], (*kv_it)[2]);
+            p.emplace((*kv_it)[1], (*kv_it)[2]);
+        f(std::move(p));
     }
+}
+
+template <typename It>
+std::vector<passport> read_passports(It begin, It end)
+{
+    std::vector<passport> passports;
+    for_each_passport(begin, end, [&] (passport && p) { passports.push_back(std::move(p)); });
     return passports;
 }
 
+// Counts the passports valid according to each of the validators straight
+// from the input, without materializing the passports, in parallel over
+// chunks of whole passports
+template <auto... Validators>
+auto count_valid_fused(std::string_view input, thread_pool & pool = shared_pool())
+{
+    using counter = valid_counter<Validators...>;
+    auto chunks = split_into_chunks(input, 4 * pool.size(), "\n\n");
+    return parallel_reduce(pool, 0, chunks.size(), 1, typename counter::counts_t {}, [&] (std::size_t begin, std::size_t end) {
+        counter c;
+        for (auto i = begin; i < end; ++i)
+            for_each_passport(chunks[i].begin(), chunks[i].end(), std::ref(c));
+        return c.counts;
+    }, counter::add);
+}
+
+// Same as the validator of the required field with the given index (in
+// required_fields), without regular expressions
+bool field_valid(std::size_t field, std::string_view value)
+{
+    auto digits = [] (std::string_view s) {
+        return !s.empty() && std::all_of(s.begin(), s.end(), [] (char c) { return c >= '0' && c <= '9'; });
+    };
+    auto number_between = [&] (std::string_view s, unsigned min, unsigned max) {
+        unsigned n = 0;
+        for (auto c: s)
+            n = 10 * n + (c - '0');
+        return digits(s) && between_inclusive(n, min, max);
+    };
+    auto with_suffix = [&] (std::string_view suffix) {
+        return value.size() > suffix.size() && value.substr(value.size() - suffix.size()) == suffix;
+    };
+    switch (field) {
+    case 0: return value.size() == 4 && number_between(value, 1920, 2002);
+    case 1: return value.size() == 4 && number_between(value, 2010, 2020);
+    case 2: return value.size() == 4 && number_between(value, 2020, 2030);
+    case 3: {
+        auto number = value.substr(0, value.size() - std::min<std::size_t>(value.size(), 2));
+        return (number.size() == 2 || number.size() == 3)
+                && ((with_suffix("cm") && number_between(number, 150, 193)) || (with_suffix("in") && number_between(number, 59, 76)));
+    }
+    case 4: return value.size() == 7 && value[0] == '#'
+                && std::all_of(value.begin() + 1, value.end(), [] (char c) { return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'f'); });
+    case 5: {
+        static constexpr std::array<std::string_view, 7> colors { "amb", "blu", "brn", "gry", "grn", "hzl", "oth" };
+        return std::find(colors.begin(), colors.end(), value) != colors.end();
+    }
+    case 6: return value.size() == 9 && digits(value);
+    }
+    return false;
+}
+
+// Where a field value is in the chars of a passports_view
+struct field_slot {
+    static constexpr auto missing = std::numeric_limits<std::uint32_t>::max();
+
+    std::uint32_t offset;
+    std::uint32_t size;
+};
+
+// The required fields of passports in flat arrays where they are stored (e.g.
+// in a snapshot): field f of passport p is at slots[p * required_fields.size() + f]
+struct passports_view {
+    std::size_t size;
+    field_slot const * slots;
+    char const * chars;
+
+    std::optional<std::string_view> field(std::size_t p, std::size_t f) const
+    {
+        auto slot = slots[p * required_fields.size() + f];
+        return slot.offset != field_slot::missing ? std::optional { std::string_view { chars + slot.offset, slot.size } } : std::nullopt;
+    }
+};
+
+// Same as count_valid_fused<is_loosely_valid, is_strictly_valid>, with the
+// fields checked in place
+auto count_valid_fused(passports_view passports, thread_pool & pool = shared_pool())
+{
+    using counter = valid_counter<is_loosely_valid, is_strictly_valid>;
+    return parallel_reduce(pool, 0, passports.size, 64, counter::counts_t {}, [&] (std::size_t begin, std::size_t end) {
+        counter::counts_t counts {};
+        for (auto p = begin; p < end; ++p) {
+            bool loosely = true;
+            bool strictly = true;
+            for (std::size_t f = 0; f < required_fields.size() && loosely; ++f) {
+                auto value = passports.field(p, f);
+                loosely = value.has_value();
+                strictly = loosely && strictly && field_valid(f, *value);
+            }
+            counts[0] += loosely;
+            counts[1] += strictly;
+        }
+        return counts;
+    }, counter::add);
+}
+
+// Stored as the passports_view arrays, each preceded by its size
+void save_snapshot(snapshot_writer & w, std::vector<passport> const & passports)
+{
+    std::vector<field_slot> slots;
+    std::string chars;
+    for (auto const & p: passports)
+        for (auto field: required_fields) {
+            auto it = p.find(std::string { field });
+            if (it == p.end()) {
+                slots.push_back({ field_slot::missing, 0 });
+                continue;
+            }
+            slots.push_back({ static_cast<std::uint32_t>(chars.size()), static_cast<std::uint32_t>(it->second.size()) });
+            chars += it->second;
+        }
+    w.write(std::uint64_t { passports.size() });
+    w.write_array(slots.data(), slots.size());
+    w.write(std::uint64_t { chars.size() });
+    w.write_array(chars.data(), chars.size());
+}
+
+std::optional<passports_view> load_passports(snapshot_reader & r)
+{
+    passports_view passports;
+    passports.size = r.read_size();
+    auto const n_slots = passports.size * required_fields.size();
+    passports.slots = r.read_array<field_slot>(n_slots);
+    auto n_chars = r.read_size();
+    passports.chars = r.read_array<char>(n_chars);
+    if (!passports.chars || !std::all_of(passports.slots, passports.slots + n_slots, [n_chars] (auto const & slot) {
+            return slot.offset == field_slot::missing || (slot.offset <= n_chars && slot.size <= n_chars - slot.offset);
+        }))
+        return std::nullopt;
+    return passports;
+}
+
+constexpr std::string_view example_valid_passports =
+        "pid:087499704 hgt:74in ecl:grn iyr:2012 eyr:2030 byr:1980\n"
+        "hcl:#623a2f\n"
+        "\n"
+        "eyr:2029 ecl:blu cid:129 byr:1989\n"
+        "iyr:2014 pid:896056539 hcl:#a97842 hgt:165cm\n"
+        "\n"
+        "hcl:#888785\n"
+        "hgt:164cm byr:2001 iyr:2015 cid:88\n"
+        "pid:545766238 ecl:hzl\n"
+        "eyr:2022\n"
+        "\n"
+        "iyr:2010 hgt:158cm hcl:#b6652a ecl:blu byr:1944 eyr:2021 pid:093154719\n";
+
 void test()
 {
     const std::string_view input =
@@ -115,6 +317,11 @@ void test()
             "iyr:2011 ecl:brn hgt:59in\n";
     auto passports = read_passports(input.begin(), input.end());
     assert(count_valid(passports, is_loosely_valid) == 2);
+    using expected_counts = std::array<std::size_t, 2>;
+    assert((count_valid_fused<is_loosely_valid, is_strictly_valid>(passports) == expected_counts { 2, 2 }));
+    thread_pool pool(3);
+    assert((count_valid_fused<is_strictly_valid, is_loosely_valid>(input, pool) == expected_counts { 2, 2 }));
+    assert(count_valid(passports, is_loosely_valid, pool) == 2);
 
     assert(byr_valid("2002"));
     assert(!byr_valid("2003"));
@@ -129,6 +336,13 @@ void test()
     assert(!ecl_valid("wat"));
     assert(pid_valid("000000001"));
     assert(!pid_valid("0123456789"));
+    for (std::string value: { "1919", "1920", "2002", "2003", "2010", "2020", "2030", "0202", "20x0", "202",
+            "60in", "190cm", "190in", "190", "58in", "cm", "1500cm", "#123abc", "#123abz", "123abc", "#123abcd",
+            "brn", "wat", "oth", "000000001", "0123456789", "00000001a" }) {
+        std::array<bool (*)(std::string const &), 7> validators { byr_valid, iyr_valid, eyr_valid, hgt_valid, hcl_valid, ecl_valid, pid_valid };
+        for (std::size_t f = 0; f < validators.size(); ++f)
+            assert(field_valid(f, value) == validators[f](value));
+    }
 
     const std::string_view all_invalid_input =
             "eyr:1972 cid:100\n"
@@ -146,31 +360,147 @@ void test()
             "pid:3556412378 byr:2007\n";
     auto invalid_passports = read_passports(all_invalid_input.begin(), all_invalid_input.end());
     assert(std::none_of(invalid_passports.begin(), invalid_passports.end(), is_strictly_valid));
+    assert((count_valid_fused<is_loosely_valid, is_strictly_valid>(all_invalid_input, pool) == expected_counts { 4, 0 }));
 
-    const std::string_view all_valid_input =
-            "pid:087499704 hgt:74in ecl:grn iyr:2012 eyr:2030 byr:1980\n"
-            "hcl:#623a2f\n"
-            "\n"
-            "eyr:2029 ecl:blu cid:129 byr:1989\n"
-            "iyr:2014 pid:896056539 hcl:#a97842 hgt:165cm\n"
-            "\n"
-            "hcl:#888785\n"
-            "hgt:164cm byr:2001 iyr:2015 cid:88\n"
-            "pid:545766238 ecl:hzl\n"
-            "eyr:2022\n"
-            "\n"
-            "iyr:2010 hgt:158cm hcl:#b6652a ecl:blu byr:1944 eyr:2021 pid:093154719\n";
-    auto valid_passports = read_passports(all_valid_input.begin(), all_valid_input.end());
+    auto valid_passports = read_passports(example_valid_passports.begin(), example_valid_passports.end());
     assert(std::all_of(valid_passports.begin(), valid_passports.end(), is_strictly_valid));
+
+    snapshot_writer w;
+    save_snapshot(w, passports);
+    invalid_passports.insert(invalid_passports.end(), valid_passports.begin(), valid_passports.end());
+    save_snapshot(w, invalid_passports);
+    auto payload = w.release();
+    snapshot_reader r(payload.data(), payload.size());
+    auto slotted = load_passports(r);
+    assert(slotted && slotted->size == 4 && slotted->field(0, 0) == "1937" && !slotted->field(1, 3));
+    assert((count_valid_fused(*slotted, pool) == expected_counts { 2, 2 }));
+    slotted = load_passports(r);
+    assert(slotted && r.ok() && (count_valid_fused(*slotted, pool) == expected_counts { 8, 4 }));
+}
+
+// Tests that need files, run by "--self-test" rather than on every run
+void self_test()
+{
+    // Counting a file resumes from its checkpoint once more is appended, here
+    // after the first newline of a blank line separator
+    std::string const path = "day-04-self-test.input";
+    auto create = [] (std::string const & path) {
+        auto fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            fmt::print(stderr, "Cannot create {}: {}\n", path, std::strerror(errno));
+            std::exit(EXIT_FAILURE);
+        }
+        return fd;
+    };
+    std::remove((path + ".checkpoint").c_str());
+    auto fd = create(path);
+    using counter = valid_counter<is_loosely_valid, is_strictly_valid>;
+    auto count_file = [&] {
+        return count_incrementally<counter::counts_t>(path, "day-04", "\n\n", [] (std::string_view text) {
+            return count_valid_fused<is_loosely_valid, is_strictly_valid>(text, sequential_pool());
+        }, counter::add);
+    };
+    auto const expected = count_valid_fused<is_loosely_valid, is_strictly_valid>(example_valid_passports, sequential_pool());
+    auto const split = example_valid_passports.find("\n\n") + 1;
+    auto written = write(fd, example_valid_passports.data(), split);
+    assert(written == static_cast<ssize_t>(split));
+    auto first = count_file();
+    assert(first.resumed_at == 0 && (first.counts == counter::counts_t { 1, 1 }));
+    written = write(fd, example_valid_passports.data() + split, example_valid_passports.size() - split);
+    assert(written == static_cast<ssize_t>(example_valid_passports.size() - split));
+    close(fd);
+    auto second = count_file();
+    assert(second.resumed_at == split && second.bytes_read == example_valid_passports.size() - split && second.counts == expected);
+    // Replaced by another file with the same content
+    auto const other_path = path + ".new";
+    fd = create(other_path);
+    written = write(fd, example_valid_passports.data(), example_valid_passports.size());
+    assert(written == static_cast<ssize_t>(example_valid_passports.size()));
+    close(fd);
+    auto renamed = std::rename(other_path.c_str(), path.c_str());
+    assert(renamed == 0);
+    auto third = count_file();
+    assert(third.resumed_at == 0 && third.counts == expected);
+    std::remove(path.c_str());
+    std::remove((path + ".checkpoint").c_str());
 }
 
-int main()
+int main(int argc, char * argv[])
 {
     test();
 
-    std::ifstream in("input/day-04");
-    std::vector<char> input(std::istreambuf_iterator<char> { in }, std::istreambuf_iterator<char> {});
-    auto passports = read_passports(input.begin(), input.end());
-    fmt::print("Valid passports (loosely): {}\n", count_valid(passports, is_loosely_valid));
-    fmt::print("Valid passports (strictly): {}\n", count_valid(passports, is_strictly_valid));
+    options opts(argc, argv);
+    if (opts.has("--self-test")) {
+        self_test();
+        return 0;
+    }
+    perf_report perf(opts);
+    configure_shared_pool(opts);
+    engine_selector engines(opts);
+    using counter = valid_counter<is_loosely_valid, is_strictly_valid>;
+    auto count_reference = [] (std::string_view text) {
+        auto passports = read_passports(text.begin(), text.end());
+        return counter::counts_t {
+                static_cast<std::size_t>(count_valid(passports, is_loosely_valid, sequential_pool())),
+                static_cast<std::size_t>(count_valid(passports, is_strictly_valid, sequential_pool())) };
+    };
+    auto count_fused = [] (std::string_view text) {
+        return count_valid_fused<is_loosely_valid, is_strictly_valid>(text);
+    };
+    std::string const input_path { opts.value_or("--input", "input/day-04") };
+    // Blocks of whole passports are counted while the next ones are being read
+    auto count_piped = [&] {
+        return perf.measure("read+parse+parts 1,2", [&] {
+            counter::counts_t counts {};
+            pipe_reader reader(STDIN_FILENO, opts);
+            reader.for_each_block("\n\n", [&] (std::string_view block) {
+                counts = counter::add(counts, engines.run("parts 1,2", block.size(), 1 << 12,
+                        [&] { return count_reference(block); }, [&] { return count_fused(block); }));
+            });
+            return counts;
+        });
+    };
+    auto read_input = [&] {
+        std::ifstream in(input_path);
+        return std::vector<char>(std::istreambuf_iterator<char> { in }, std::istreambuf_iterator<char> {});
+    };
+    auto count_file = [&] {
+        auto input = perf.measure("read", read_input);
+        std::string_view const text { input.data(), input.size() };
+        return perf.measure("parse+parts 1,2", [&] {
+            return engines.run("parts 1,2", input.size(), 1 << 12, [&] { return count_reference(text); }, [&] { return count_fused(text); });
+        });
+    };
+    // The snapshot holds the required fields in the flat form the fast engine
+    // checks, so with it the fast engine is used whatever the input size
+    auto const snapshot = opts.has("--snapshot");
+    if (snapshot && !engines.use_fast(0, 0) && !engines.verifying())
+        fmt::print(stderr, "--snapshot has no effect with --engine=reference\n");
+    auto count_snapshotted = [&] {
+        auto passports = perf.measure("parse", [&] {
+            return parse_with_snapshot<passports_view>(input_path,
+                    [] (std::string_view text) { return read_passports(text.begin(), text.end()); }, save_snapshot, load_passports);
+        });
+        return perf.measure("parts 1,2", [&] {
+            return engines.run("parts 1,2", passports.view.size, 0, [&] {
+                auto input = read_input();
+                return count_reference({ input.data(), input.size() });
+            }, [&] { return count_valid_fused(passports.view); });
+        });
+    };
+    // Only the bytes appended since the last run are read and counted
+    auto count_checkpointed = [&] {
+        auto result = perf.measure("read+parse+parts 1,2", [&] {
+            return count_incrementally<counter::counts_t>(input_path, "day-04", "\n\n", [&] (std::string_view text) {
+                return engines.run("parts 1,2", text.size(), 1 << 12, [&] { return count_reference(text); }, [&] { return count_fused(text); });
+            }, counter::add);
+        });
+        fmt::print(stderr, "Resumed from checkpoint at byte {}, read {} new bytes\n", result.resumed_at, result.bytes_read);
+        return result.counts;
+    };
+    auto [loosely_valid, strictly_valid] = opts.has("--stdin") ? count_piped()
+            : opts.has("--incremental") ? count_checkpointed()
+            : snapshot && (engines.use_fast(0, 0) || engines.verifying()) ? count_snapshotted() : count_file();
+    fmt::print("Valid passports (loosely): {}\n", loosely_valid);
+    fmt::print("Valid passports (strictly): {}\n", strictly_valid);
 }
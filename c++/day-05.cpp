@@ -1,10 +1,16 @@
 // https://adventofcode.com/2020/day/5
 
+#include "engine.h"
+#include "options.h"
+#include "perf_counters.h"
+#include "pipe_reader.h"
 #include <fmt/os.h>
 #include <algorithm>
+#include <bitset>
 #include <cassert>
 #include <fstream>
 #include <numeric>
+#include <optional>
 #include <regex>
 #include <string>
 #include <string_view>
@@ -42,31 +48,78 @@ seat decode_seat(std::string_view encoding)
     return { row_range.start, col_range.start };
 }
 
+std::optional<unsigned int> find_missing_seat_id(std::vector<unsigned int> seat_ids)
+{
+    std::sort(seat_ids.begin(), seat_ids.end());
+    auto before_missing_it = std::adjacent_find(seat_ids.begin(), seat_ids.end(), [] (auto s1, auto s2) {
+        return s2 - s1 == 2;
+    });
+    if (before_missing_it == seat_ids.end())
+        return std::nullopt;
+    return *before_missing_it + 1;
+}
+
+// Same as above, marking the taken seats in a bit set instead of sorting
+std::optional<unsigned int> find_missing_seat_id_marked(std::vector<unsigned int> const & seat_ids)
+{
+    std::bitset<128 * 8> taken;
+    for (auto id: seat_ids)
+        taken.set(id);
+    for (std::size_t id = 1; id + 1 < taken.size(); ++id)
+        if (!taken[id] && taken[id - 1] && taken[id + 1])
+            return static_cast<unsigned int>(id);
+    return std::nullopt;
+}
+
 void test()
 {
     assert(id(decode_seat("FBFBBFFRLR")) == 357);
     assert(id(decode_seat("BFFFBBFRRR")) == 567);
     assert(id(decode_seat("FFFBBBFRRR")) == 119);
     assert(id(decode_seat("BBFFBBFRLL")) == 820);
+    std::vector<unsigned int> const seat_ids { 12, 9, 8, 11, 13 };
+    assert(find_missing_seat_id(seat_ids) == 10u);
+    assert(find_missing_seat_id_marked(seat_ids) == 10u);
+    assert(!find_missing_seat_id_marked({ 8, 9, 10 }));
 }
 
-int main()
+int main(int argc, char * argv[])
 {
     test();
 
-    std::ifstream in("input/day-05");
-    std::vector<unsigned int> seat_ids;
-    std::string seat_encoding;
-    while (std::getline(in, seat_encoding))
-        seat_ids.push_back(id(decode_seat(seat_encoding)));
+    options opts(argc, argv);
+    engine_selector engines(opts);
+    perf_report perf(opts);
+    auto seat_ids = opts.has("--stdin")
+            ? perf.measure("read+parse", [&] {
+                // Blocks of whole lines are decoded while the next ones are being read
+                std::vector<unsigned int> seat_ids;
+                pipe_reader reader(STDIN_FILENO, opts);
+                reader.for_each_block("\n", [&] (std::string_view block) {
+                    for (std::size_t pos = 0; pos < block.size(); ) {
+                        auto end = std::min(block.find('\n', pos), block.size());
+                        seat_ids.push_back(id(decode_seat(block.substr(pos, end - pos))));
+                        pos = end + 1;
+                    }
+                });
+                return seat_ids;
+            })
+            : perf.measure("parse", [&] {
+                std::ifstream in(std::string { opts.value_or("--input", "input/day-05") });
+                std::vector<unsigned int> seat_ids;
+                std::string seat_encoding;
+                while (std::getline(in, seat_encoding))
+                    seat_ids.push_back(id(decode_seat(seat_encoding)));
+                return seat_ids;
+            });
 
     assert(!seat_ids.empty());
-    fmt::print("Highest seat ID: {}\n", *std::max_element(seat_ids.begin(), seat_ids.end()));
+    fmt::print("Highest seat ID: {}\n", perf.measure("part 1", [&] { return *std::max_element(seat_ids.begin(), seat_ids.end()); }));
 
-    std::sort(seat_ids.begin(), seat_ids.end());
-    auto before_missing_it = std::adjacent_find(seat_ids.begin(), seat_ids.end(), [] (auto s1, auto s2) {
-        return s2 - s1 == 2;
+    auto missing_id = perf.measure("part 2", [&] {
+        return engines.run("part 2", seat_ids.size(), 256,
+                [&] { return find_missing_seat_id(seat_ids); },
+                [&] { return find_missing_seat_id_marked(seat_ids); });
     });
-    assert(before_missing_it != seat_ids.end());
-    fmt::print("Missing seat ID: {}\n", *before_missing_it + 1);
+    fmt::print("Missing seat ID: {}\n", missing_id.value());
 }
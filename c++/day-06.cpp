@@ -1,14 +1,31 @@
 // https://adventofcode.com/2020/day/6
 
+#include "checkpoint.h"
+#include "engine.h"
+#include "options.h"
+#include "perf_counters.h"
+#include "pipe_reader.h"
+#include "snapshot.h"
+#include "thread_pool.h"
+#include <fcntl.h>
+#include <unistd.h>
 #include <fmt/os.h>
 #include <algorithm>
+#include <array>
 #include <cassert>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <fstream>
+#include <functional>
 #include <iterator>
 #include <numeric>
+#include <optional>
 #include <regex>
 #include <set>
+#include <string>
 #include <string_view>
 #include <vector>
 
@@ -16,10 +33,12 @@ using individual_answer = std::set<char>;
 using group_answer = std::vector<individual_answer>;
 
 template <typename CountStrategy>
-auto sum_group_answers(std::vector<group_answer> const & answers, CountStrategy strategy)
+auto sum_group_answers(std::vector<group_answer> const & answers, CountStrategy strategy, thread_pool & pool = shared_pool())
 {
-    return std::accumulate(answers.begin(), answers.end(), std::size_t { 0 },
-            [&] (auto s, auto const & answer) { return s + strategy(answer); });
+    return parallel_reduce(pool, 0, answers.size(), 256, std::size_t { 0 }, [&] (std::size_t begin, std::size_t end) {
+        return std::accumulate(answers.begin() + begin, answers.begin() + end, std::size_t { 0 },
+                [&] (auto s, auto const & answer) { return s + strategy(answer); });
+    }, std::plus<> {});
 }
 
 std::size_t any_answered_count(group_answer const & answer)
@@ -43,53 +62,284 @@ std::size_t all_answered_count(group_answer const & answer)
         }).size();
 }
 
-template <typename It>
-std::vector<group_answer> read_group_answers(It begin, It end)
+// Sums the group answer counts of each of the strategies, as one visitor
+template <auto... CountStrategies>
+struct answer_summer {
+    using sums_t = std::array<std::size_t, sizeof...(CountStrategies)>;
+    sums_t sums {};
+
+    void operator()(group_answer const & answer)
+    {
+        std::size_t i = 0;
+        ((sums[i++] += CountStrategies(answer)), ...);
+    }
+
+    static sums_t add(sums_t lhs, sums_t const & rhs)
+    {
+        std::transform(lhs.begin(), lhs.end(), rhs.begin(), lhs.begin(), std::plus<> {});
+        return lhs;
+    }
+};
+
+template <auto... CountStrategies>
+auto sum_group_answers_fused(std::vector<group_answer> const & answers, thread_pool & pool = shared_pool())
+{
+    using summer = answer_summer<CountStrategies...>;
+    return parallel_reduce(pool, 0, answers.size(), 256, typename summer::sums_t {}, [&] (std::size_t begin, std::size_t end) {
+        summer s;
+        std::for_each(answers.begin() + begin, answers.begin() + end, std::ref(s));
+        return s.sums;
+    }, summer::add);
+}
+
+template <typename It, typename F>
+void for_each_group_answer(It begin, It end, F f)
 {
-    std::vector<group_answer> answers;
     std::regex group_answer_regex { R"(\n\n)" };
     std::regex ind_answer_regex { R"(\n)" };
     for (auto group_it = std::regex_token_iterator<It> { begin, end, group_answer_regex, -1 }; group_it != std::regex_token_iterator<It> {}; ++group_it) {
-        answers.emplace_back();
-        for (auto ind_it = std::regex_token_iterator<It> { group_it->first, group_it->second, ind_answer_regex, -1 }; ind_it != std::regex_token_iterator<It> {}; ++ind_it) {
-            answers.back().emplace_back();
-            for (auto it = ind_it->first; it != ind_it->second; ++it)
-                answers.back().back().insert(*it);
+        group_answer answer;
+        for (auto ind_it = std::regex_token_iterator<It> { group_it->first, group_it->second, ind_answer_regex, -1 }; ind_it != std::regex_token_iterator<It> {}; ++ind_it)
+            answer.emplace_back(ind_it->first, ind_it->second);
+        f(std::move(answer));
+    }
+}
+
+template <typename It>
+std::vector<group_answer> read_group_answers(It begin, It end)
+{
+    std::vector<group_answer> answers;
+    for_each_group_answer(begin, end, [&] (group_answer && answer) { answers.push_back(std::move(answer)); });
+    return answers;
+}
+
+// Sums the group answer counts of each of the strategies straight from the
+// input, without materializing the answers, in parallel over chunks of whole
+// groups
+template <auto... CountStrategies>
+auto sum_group_answers_fused(std::string_view input, thread_pool & pool = shared_pool())
+{
+    using summer = answer_summer<CountStrategies...>;
+    auto chunks = split_into_chunks(input, 4 * pool.size(), "\n\n");
+    return parallel_reduce(pool, 0, chunks.size(), 1, typename summer::sums_t {}, [&] (std::size_t begin, std::size_t end) {
+        summer s;
+        for (auto i = begin; i < end; ++i)
+            for_each_group_answer(chunks[i].begin(), chunks[i].end(), std::ref(s));
+        return s.sums;
+    }, summer::add);
+}
+
+// Answers in flat arrays where they are stored (e.g. in a snapshot), each
+// individual answer as a bit mask of its questions (bit i for question 'a' + i):
+// the answers of group g are masks[group_offsets[g]..group_offsets[g + 1])
+struct group_answers_view {
+    std::size_t n_groups;
+    std::uint32_t const * group_offsets;
+    std::uint32_t const * masks;
+};
+
+// Same as sum_group_answers_fused<any_answered_count, all_answered_count>,
+// with unions and intersections of masks in place of sets
+auto sum_group_answers_fused(group_answers_view answers, thread_pool & pool = shared_pool())
+{
+    using summer = answer_summer<any_answered_count, all_answered_count>;
+    return parallel_reduce(pool, 0, answers.n_groups, 256, summer::sums_t {}, [&] (std::size_t begin, std::size_t end) {
+        summer::sums_t sums {};
+        for (auto g = begin; g < end; ++g) {
+            auto const first = answers.group_offsets[g];
+            auto const last = answers.group_offsets[g + 1];
+            std::uint32_t any = 0;
+            std::uint32_t all = first < last ? ~std::uint32_t { 0 } : 0;
+            for (auto i = first; i < last; ++i) {
+                any |= answers.masks[i];
+                all &= answers.masks[i];
+            }
+            sums[0] += __builtin_popcount(any);
+            sums[1] += __builtin_popcount(all);
         }
+        return sums;
+    }, summer::add);
+}
+
+// Stored as the group_answers_view arrays, each preceded by its size
+void save_snapshot(snapshot_writer & w, std::vector<group_answer> const & answers)
+{
+    std::vector<std::uint32_t> group_offsets { 0 };
+    std::vector<std::uint32_t> masks;
+    for (auto const & group: answers) {
+        for (auto const & individual: group) {
+            std::uint32_t mask = 0;
+            for (auto question: individual) {
+                assert(question >= 'a' && question <= 'z');
+                mask |= std::uint32_t { 1 } << (question - 'a');
+            }
+            masks.push_back(mask);
+        }
+        group_offsets.push_back(masks.size());
     }
+    w.write(std::uint64_t { answers.size() });
+    w.write_array(group_offsets.data(), group_offsets.size());
+    w.write(std::uint64_t { masks.size() });
+    w.write_array(masks.data(), masks.size());
+}
+
+std::optional<group_answers_view> load_group_answers(snapshot_reader & r)
+{
+    group_answers_view answers;
+    answers.n_groups = r.read_size();
+    answers.group_offsets = r.read_array<std::uint32_t>(answers.n_groups + 1);
+    auto n_masks = r.read_size();
+    answers.masks = r.read_array<std::uint32_t>(n_masks);
+    if (!answers.masks || answers.group_offsets[0] != 0 || answers.group_offsets[answers.n_groups] != n_masks
+            || !std::is_sorted(answers.group_offsets, answers.group_offsets + answers.n_groups + 1))
+        return std::nullopt;
     return answers;
 }
 
+constexpr std::string_view example_answers =
+        "abc\n"
+        "\n"
+        "a\n"
+        "b\n"
+        "c\n"
+        "\n"
+        "ab\n"
+        "ac\n"
+        "\n"
+        "a\n"
+        "a\n"
+        "a\n"
+        "a\n"
+        "\n"
+        "b\n";
+
 void test()
 {
-    const std::string_view input =
-            "abc\n"
-            "\n"
-            "a\n"
-            "b\n"
-            "c\n"
-            "\n"
-            "ab\n"
-            "ac\n"
-            "\n"
-            "a\n"
-            "a\n"
-            "a\n"
-            "a\n"
-            "\n"
-            "b\n";
-    auto answers = read_group_answers(input.begin(), input.end());
+    auto answers = read_group_answers(example_answers.begin(), example_answers.end());
     assert(sum_group_answers(answers, any_answered_count) == 11);
     assert(sum_group_answers(answers, all_answered_count) == 6);
+    using expected_sums = std::array<std::size_t, 2>;
+    assert((sum_group_answers_fused<any_answered_count, all_answered_count>(answers) == expected_sums { 11, 6 }));
+    thread_pool pool(3);
+    assert((sum_group_answers_fused<all_answered_count, any_answered_count>(example_answers, pool) == expected_sums { 6, 11 }));
+    assert(sum_group_answers(answers, any_answered_count, pool) == 11);
+
+    snapshot_writer w;
+    save_snapshot(w, answers);
+    auto payload = w.release();
+    snapshot_reader r(payload.data(), payload.size());
+    auto masked = load_group_answers(r);
+    assert(masked && r.ok() && masked->n_groups == 5 && masked->masks[0] == 7);
+    assert((sum_group_answers_fused(*masked, pool) == expected_sums { 11, 6 }));
+}
+
+// Tests that need files, run by "--self-test" rather than on every run
+void self_test()
+{
+    // Appending to a group in the middle of a blank line, then resuming
+    std::string const path = "day-06-self-test.input";
+    std::remove((path + ".checkpoint").c_str());
+    auto fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        fmt::print(stderr, "Cannot create {}: {}\n", path, std::strerror(errno));
+        std::exit(EXIT_FAILURE);
+    }
+    using summer = answer_summer<any_answered_count, all_answered_count>;
+    auto sum_file = [&] {
+        return count_incrementally<summer::sums_t>(path, "day-06", "\n\n", [] (std::string_view text) {
+            return sum_group_answers_fused<any_answered_count, all_answered_count>(text, sequential_pool());
+        }, summer::add);
+    };
+    std::size_t written = 0;
+    for (auto end: { example_answers.find("ac\n") + 3, example_answers.find("ac\n") + 4, example_answers.size() }) {
+        auto n = write(fd, example_answers.data() + written, end - written);
+        assert(n == static_cast<ssize_t>(end - written));
+        auto result = sum_file();
+        assert(result.resumed_at == written && result.bytes_read == end - written);
+        assert(result.counts == (sum_group_answers_fused<any_answered_count, all_answered_count>(example_answers.substr(0, end), sequential_pool())));
+        written = end;
+    }
+    close(fd);
+    std::remove(path.c_str());
+    std::remove((path + ".checkpoint").c_str());
 }
 
-int main()
+int main(int argc, char * argv[])
 {
     test();
 
-    std::ifstream in("input/day-06");
-    std::vector<char> input(std::istreambuf_iterator<char> { in }, std::istreambuf_iterator<char> {});
-    auto answers = read_group_answers(input.begin(), input.end());
-    fmt::print("Sum of answer count (any): {}\n", sum_group_answers(answers, any_answered_count));
-    fmt::print("Sum of answer count (all): {}\n", sum_group_answers(answers, all_answered_count));
+    options opts(argc, argv);
+    if (opts.has("--self-test")) {
+        self_test();
+        return 0;
+    }
+    perf_report perf(opts);
+    configure_shared_pool(opts);
+    engine_selector engines(opts);
+    using summer = answer_summer<any_answered_count, all_answered_count>;
+    auto sum_reference = [] (std::string_view text) {
+        auto answers = read_group_answers(text.begin(), text.end());
+        return summer::sums_t {
+                sum_group_answers(answers, any_answered_count, sequential_pool()),
+                sum_group_answers(answers, all_answered_count, sequential_pool()) };
+    };
+    auto sum_fused = [] (std::string_view text) {
+        return sum_group_answers_fused<any_answered_count, all_answered_count>(text);
+    };
+    std::string const input_path { opts.value_or("--input", "input/day-06") };
+    // Blocks of whole groups are summed while the next ones are being read
+    auto sum_piped = [&] {
+        return perf.measure("read+parse+parts 1,2", [&] {
+            summer::sums_t sums {};
+            pipe_reader reader(STDIN_FILENO, opts);
+            reader.for_each_block("\n\n", [&] (std::string_view block) {
+                sums = summer::add(sums, engines.run("parts 1,2", block.size(), 1 << 12,
+                        [&] { return sum_reference(block); }, [&] { return sum_fused(block); }));
+            });
+            return sums;
+        });
+    };
+    auto read_input = [&] {
+        std::ifstream in(input_path);
+        return std::vector<char>(std::istreambuf_iterator<char> { in }, std::istreambuf_iterator<char> {});
+    };
+    auto sum_file = [&] {
+        auto input = perf.measure("read", read_input);
+        std::string_view const text { input.data(), input.size() };
+        return perf.measure("parse+parts 1,2", [&] {
+            return engines.run("parts 1,2", input.size(), 1 << 12, [&] { return sum_reference(text); }, [&] { return sum_fused(text); });
+        });
+    };
+    // The snapshot holds the answers as the masks the fast engine sums, so
+    // with it the fast engine is used whatever the input size
+    auto const snapshot = opts.has("--snapshot");
+    if (snapshot && !engines.use_fast(0, 0) && !engines.verifying())
+        fmt::print(stderr, "--snapshot has no effect with --engine=reference\n");
+    auto sum_snapshotted = [&] {
+        auto answers = perf.measure("parse", [&] {
+            return parse_with_snapshot<group_answers_view>(input_path,
+                    [] (std::string_view text) { return read_group_answers(text.begin(), text.end()); }, save_snapshot, load_group_answers);
+        });
+        return perf.measure("parts 1,2", [&] {
+            return engines.run("parts 1,2", answers.view.n_groups, 0, [&] {
+                auto input = read_input();
+                return sum_reference({ input.data(), input.size() });
+            }, [&] { return sum_group_answers_fused(answers.view); });
+        });
+    };
+    // Only the bytes appended since the last run are read and summed
+    auto sum_checkpointed = [&] {
+        auto result = perf.measure("read+parse+parts 1,2", [&] {
+            return count_incrementally<summer::sums_t>(input_path, "day-06", "\n\n", [&] (std::string_view text) {
+                return engines.run("parts 1,2", text.size(), 1 << 12, [&] { return sum_reference(text); }, [&] { return sum_fused(text); });
+            }, summer::add);
+        });
+        fmt::print(stderr, "Resumed from checkpoint at byte {}, read {} new bytes\n", result.resumed_at, result.bytes_read);
+        return result.counts;
+    };
+    auto [any_sum, all_sum] = opts.has("--stdin") ? sum_piped()
+            : opts.has("--incremental") ? sum_checkpointed()
+            : snapshot && (engines.use_fast(0, 0) || engines.verifying()) ? sum_snapshotted() : sum_file();
+    fmt::print("Sum of answer count (any): {}\n", any_sum);
+    fmt::print("Sum of answer count (all): {}\n", all_sum);
 }
@@ -1,12 +1,23 @@
 // https://adventofcode.com/2020/day/7
 
+#include "engine.h"
+#include "flat_hash.h"
+#include "options.h"
+#include "parse.h"
+#include "perf_counters.h"
+#include "snapshot.h"
 #include <fmt/os.h>
 #include <algorithm>
 #include <cassert>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
 #include <cstdlib>
 #include <fstream>
+#include <iostream>
 #include <iterator>
 #include <numeric>
+#include <optional>
 #include <regex>
 #include <string>
 #include <string_view>
@@ -18,27 +29,29 @@ using bag_rules = std::unordered_map<std::string, content>;
 
 bool search_bag_colors_containing(
         std::string const & target_color, std::string const & start_color,
-        bag_rules const & rules, std::unordered_map<std::string, bool> & processed_colors)
+        bag_rules const & rules, flat_hash_map<std::string, bool> & processed_colors)
 {
-    if (auto it = processed_colors.find(start_color); it != processed_colors.end())
-        return it->second;
+    if (auto processed = processed_colors.find(start_color))
+        return *processed;
     auto found = false;
     for (auto & [color, _]: rules.at(start_color))
         if (color == target_color || search_bag_colors_containing(target_color, color, rules, processed_colors)) {
             found = true;
             break;
         }
-    processed_colors.emplace(start_color, found);
+    processed_colors.try_emplace(start_color, found);
     return found;
 }
 
 auto find_bag_colors_containing(std::string const & target_color, bag_rules const & rules)
 {
-    std::unordered_map<std::string, bool> processed_colors;
+    flat_hash_map<std::string, bool> processed_colors(rules.size());
     for (auto const & [color, _]: rules)
         if (color != target_color)
             search_bag_colors_containing(target_color, color, rules, processed_colors);
-    return std::count_if(processed_colors.begin(), processed_colors.end(), [] (auto const & kv) { return kv.second; });
+    std::ptrdiff_t count = 0;
+    processed_colors.for_each([&] (auto const &, bool found) { count += found; });
+    return count;
 }
 
 auto bags_inside(std::string const & color, bag_rules const & rules)
@@ -48,6 +61,207 @@ auto bags_inside(std::string const & color, bag_rules const & rules)
             [&] (auto count, auto const & kv) { return count + kv.second * (1 + bags_inside(kv.first, rules)); });
 }
 
+// Bit set stored as its non-zero 64-bit words only
+struct compressed_bitset {
+public:
+    compressed_bitset() = default;
+
+    explicit compressed_bitset(std::vector<std::uint64_t> const & dense)
+    {
+        for (std::size_t i = 0; i < dense.size(); ++i)
+            if (dense[i] != 0) {
+                word_indices.push_back(i);
+                words.push_back(dense[i]);
+                n_set += __builtin_popcountll(dense[i]);
+            }
+        word_indices.shrink_to_fit();
+        words.shrink_to_fit();
+    }
+
+    bool test(std::size_t bit) const
+    {
+        auto it = std::lower_bound(word_indices.begin(), word_indices.end(), bit / 64);
+        return it != word_indices.end() && *it == bit / 64
+                && (words[it - word_indices.begin()] >> (bit % 64) & 1) != 0;
+    }
+
+    void or_into(std::vector<std::uint64_t> & dense) const
+    {
+        for (std::size_t i = 0; i < words.size(); ++i)
+            dense[word_indices[i]] |= words[i];
+    }
+
+    std::size_t count() const { return n_set; }
+
+    std::size_t memory_footprint() const
+    {
+        return sizeof(*this) + word_indices.capacity() * sizeof(std::uint32_t) + words.capacity() * sizeof(std::uint64_t);
+    }
+
+private:
+    std::vector<std::uint32_t> word_indices;
+    std::vector<std::uint64_t> words;
+    std::size_t n_set = 0;
+};
+
+// Content item of an interned rule: the inner color and the count
+struct content_item {
+    std::uint32_t color;
+    std::uint32_t count;
+};
+
+// Rules with the colors interned as ids 0..n_colors-1, in flat arrays where
+// they are stored (e.g. in a snapshot): the name of color c is
+// names[name_offsets[c]..name_offsets[c + 1]) and its content is
+// items[item_offsets[c]..item_offsets[c + 1])
+struct bag_graph {
+    std::size_t n_colors;
+    std::uint32_t const * name_offsets;
+    char const * names;
+    std::uint32_t const * item_offsets;
+    content_item const * items;
+
+    std::string_view name(std::size_t c) const { return { names + name_offsets[c], name_offsets[c + 1] - name_offsets[c] }; }
+    content_item const * content_begin(std::size_t c) const { return items + item_offsets[c]; }
+    content_item const * content_end(std::size_t c) const { return items + item_offsets[c + 1]; }
+};
+
+// Rules loaded once with the answers to "which colors can contain X" (as the
+// set of ancestors of X) and "how many bags are inside X" precomputed for
+// every color. Color names are looked up as views into the graph, which has
+// to outlive the index.
+struct bag_rule_index {
+public:
+    explicit bag_rule_index(bag_graph const & graph)
+        : ids(graph.n_colors)
+    {
+        auto const n = graph.n_colors;
+        for (std::size_t c = 0; c < n; ++c)
+            ids.try_emplace(graph.name(c), static_cast<std::uint32_t>(c));
+        // Parents of each color, in the same flat form as the content
+        std::vector<std::uint32_t> parent_offsets(n + 1);
+        for (auto item = graph.items; item != graph.items + graph.item_offsets[n]; ++item)
+            ++parent_offsets[item->color + 1];
+        std::partial_sum(parent_offsets.begin(), parent_offsets.end(), parent_offsets.begin());
+        std::vector<std::uint32_t> parents(parent_offsets[n]);
+        auto next_parent = parent_offsets;
+        for (std::size_t c = 0; c < n; ++c)
+            for (auto item = graph.content_begin(c); item != graph.content_end(c); ++item)
+                parents[next_parent[item->color]++] = c;
+
+        // Topological order with every color after all colors that directly contain it
+        std::vector<std::size_t> order;
+        std::vector<std::size_t> n_unprocessed_parents(n);
+        for (std::size_t c = 0; c < n; ++c)
+            if ((n_unprocessed_parents[c] = parent_offsets[c + 1] - parent_offsets[c]) == 0)
+                order.push_back(c);
+        for (std::size_t i = 0; i < order.size(); ++i)
+            for (auto item = graph.content_begin(order[i]); item != graph.content_end(order[i]); ++item)
+                if (--n_unprocessed_parents[item->color] == 0)
+                    order.push_back(item->color);
+        assert(order.size() == n);  // no cycles
+
+        ancestors.resize(n);
+        std::vector<std::uint64_t> scratch((n + 63) / 64);
+        for (auto c: order) {
+            std::fill(scratch.begin(), scratch.end(), 0);
+            for (auto i = parent_offsets[c]; i < parent_offsets[c + 1]; ++i) {
+                auto p = parents[i];
+                scratch[p / 64] |= std::uint64_t { 1 } << (p % 64);
+                ancestors[p].or_into(scratch);
+            }
+            ancestors[c] = compressed_bitset(scratch);
+        }
+
+        inside.resize(n);
+        for (auto it = order.rbegin(); it != order.rend(); ++it)
+            inside[*it] = std::accumulate(graph.content_begin(*it), graph.content_end(*it), std::size_t { 0 },
+                    [&] (auto count, auto const & item) { return count + item.count * (1 + inside[item.color]); });
+    }
+
+    std::optional<std::size_t> colors_containing(std::string_view color) const
+    {
+        auto id = ids.find(color);
+        return id ? std::optional { ancestors[*id].count() } : std::nullopt;
+    }
+
+    std::optional<std::size_t> bags_inside(std::string_view color) const
+    {
+        auto id = ids.find(color);
+        return id ? std::optional { inside[*id] } : std::nullopt;
+    }
+
+    std::optional<bool> can_contain(std::string_view outer_color, std::string_view inner_color) const
+    {
+        auto outer = ids.find(outer_color);
+        auto inner = ids.find(inner_color);
+        return outer && inner ? std::optional { ancestors[*inner].test(*outer) } : std::nullopt;
+    }
+
+    std::size_t n_colors() const { return inside.size(); }
+
+    std::size_t memory_footprint() const
+    {
+        auto bytes = sizeof(*this) + ids.memory_footprint() + inside.capacity() * sizeof(std::size_t);
+        for (auto const & a: ancestors)
+            bytes += a.memory_footprint();
+        return bytes;
+    }
+
+private:
+    flat_hash_map<std::string_view, std::uint32_t> ids;  // views into the graph
+    std::vector<compressed_bitset> ancestors;
+    std::vector<std::size_t> inside;
+};
+
+// Answers one query per line read from the stream:
+//   containing <color>              number of colors that can contain <color>
+//   inside <color>                  number of bags inside <color>
+//   contains <outer>, <inner>       whether <outer> can (indirectly) contain <inner>
+std::string answer_query(bag_rule_index const & index, std::string_view query)
+{
+    auto with_prefix = [&] (std::string_view prefix) {
+        return query.substr(0, prefix.size()) == prefix;
+    };
+    auto unknown = [] { return std::string { "unknown color" }; };
+    if (with_prefix("containing ")) {
+        auto n = index.colors_containing(query.substr(11));
+        return n ? std::to_string(*n) : unknown();
+    }
+    else if (with_prefix("inside ")) {
+        auto n = index.bags_inside(query.substr(7));
+        return n ? std::to_string(*n) : unknown();
+    }
+    else if (auto comma = query.find(", "); with_prefix("contains ") && comma != std::string_view::npos) {
+        auto b = index.can_contain(query.substr(9, comma - 9), query.substr(comma + 2));
+        return b ? (*b ? "yes" : "no") : unknown();
+    }
+    return "invalid query";
+}
+
+void serve_queries(bag_rule_index const & index, std::istream & in)
+{
+    fmt::print(stderr, "Loaded {} colors, index memory footprint: {} bytes\n", index.n_colors(), index.memory_footprint());
+    std::size_t n_queries = 0;
+    std::chrono::steady_clock::duration total_latency {};
+    std::string query;
+    while (std::getline(in, query)) {
+        auto start = std::chrono::steady_clock::now();
+        auto answer = answer_query(index, query);
+        total_latency += std::chrono::steady_clock::now() - start;
+        ++n_queries;
+        fmt::print("{}\n", answer);
+        // Answers to queries already buffered go out together, and none
+        // waits behind a blocking read. Streams synced with stdio buffer
+        // nothing, so this flushes every answer for them.
+        if (in.rdbuf()->in_avail() <= 0)
+            std::fflush(stdout);
+    }
+    if (n_queries > 0)
+        fmt::print(stderr, "Answered {} queries, mean latency: {:.3f} us\n", n_queries,
+                std::chrono::duration<double, std::micro>(total_latency).count() / n_queries);
+}
+
 template <typename It>
 bag_rules read_bag_rules(It begin, It end)
 {
@@ -75,6 +289,101 @@ bag_rules read_bag_rules(It begin, It end)
     return rules;
 }
 
+// Rules as (color, [(count, color)...]) tuples
+constexpr auto bag_rules_grammar = [] {
+    using namespace grammar;
+    constexpr auto color = text(word >> lit(" ") >> word);
+    constexpr auto content_item = integer<std::size_t> >> lit(" ") >> color >> lit(" bag") >> maybe(lit("s"));
+    constexpr auto no_content = map(lit("no other bags"), [] { return std::vector<std::tuple<std::size_t, std::string_view>> {}; });
+    constexpr auto rule = color >> lit(" bags contain ") >> (no_content | sep_by(content_item, lit(", "))) >> lit(".") >> (lit("\n") | end);
+    return many(rule);
+}();
+
+// Same as read_bag_rules, with a parser combinator grammar instead of regular expressions
+bag_rules parse_bag_rules(std::string_view input)
+{
+    bag_rules rules;
+    for (auto & [color, items]: grammar::parse_or_exit(bag_rules_grammar, input, "bag rules")) {
+        auto [new_rule, inserted] = rules.emplace(color, content {});
+        assert(inserted);
+        for (auto [count, inner_color]: items) {
+            auto [new_content_item, inserted] = new_rule->second.emplace(inner_color, count);
+            assert(inserted && new_content_item->second > 0);
+        }
+    }
+    return rules;
+}
+
+// Stored as the bag_graph arrays, each preceded by its size
+void save_snapshot(snapshot_writer & w, bag_rules const & rules)
+{
+    flat_hash_map<std::string_view, std::uint32_t> ids(rules.size());
+    std::vector<std::uint32_t> name_offsets { 0 };
+    std::string names;
+    for (auto const & [color, _]: rules) {
+        ids.try_emplace(color, static_cast<std::uint32_t>(ids.size()));
+        names += color;
+        name_offsets.push_back(names.size());
+    }
+    std::vector<std::uint32_t> item_offsets { 0 };
+    std::vector<content_item> items;
+    for (auto const & [_, content]: rules) {
+        for (auto const & [color, count]: content)
+            items.push_back({ *ids.find(color), static_cast<std::uint32_t>(count) });
+        item_offsets.push_back(items.size());
+    }
+    w.write(std::uint64_t { rules.size() });
+    w.write_array(name_offsets.data(), name_offsets.size());
+    w.write(std::uint64_t { names.size() });
+    w.write_array(names.data(), names.size());
+    w.write_array(item_offsets.data(), item_offsets.size());
+    w.write(std::uint64_t { items.size() });
+    w.write_array(items.data(), items.size());
+}
+
+std::optional<bag_graph> load_bag_graph(snapshot_reader & r)
+{
+    bag_graph graph;
+    graph.n_colors = r.read_size();
+    graph.name_offsets = r.read_array<std::uint32_t>(graph.n_colors + 1);
+    auto n_chars = r.read_size();
+    graph.names = r.read_array<char>(n_chars);
+    graph.item_offsets = r.read_array<std::uint32_t>(graph.n_colors + 1);
+    auto n_items = r.read_size();
+    graph.items = r.read_array<content_item>(n_items);
+    auto const n = graph.n_colors;
+    auto valid_offsets = [n] (std::uint32_t const * offsets, std::size_t size) {
+        return offsets[0] == 0 && offsets[n] == size && std::is_sorted(offsets, offsets + n + 1);
+    };
+    if (!graph.items || !valid_offsets(graph.name_offsets, n_chars) || !valid_offsets(graph.item_offsets, n_items)
+            || !std::all_of(graph.items, graph.items + n_items, [n] (auto const & item) { return item.color < n; }))
+        return std::nullopt;
+    return graph;
+}
+
+// The rules interned in memory, in the same form as in a snapshot
+loaded_snapshot<bag_graph> intern(bag_rules const & rules)
+{
+    snapshot_writer w;
+    save_snapshot(w, rules);
+    mapped_file data(w.release());
+    snapshot_reader r(data.data, data.size);
+    auto graph = load_bag_graph(r);
+    assert(graph && r.ok());
+    return { std::move(data), *graph };
+}
+
+bag_rules unintern(bag_graph const & graph)
+{
+    bag_rules rules;
+    for (std::size_t c = 0; c < graph.n_colors; ++c) {
+        auto & content = rules[std::string { graph.name(c) }];
+        for (auto item = graph.content_begin(c); item != graph.content_end(c); ++item)
+            content.emplace(graph.name(item->color), item->count);
+    }
+    return rules;
+}
+
 void test()
 {
     const std::string_view input =
@@ -88,9 +397,24 @@ void test()
             "faded blue bags contain no other bags.\n"
             "dotted black bags contain no other bags.\n";
     auto rules = read_bag_rules(input.begin(), input.end());
+    assert(parse_bag_rules(input) == rules);
+    assert(grammar::parse(bag_rules_grammar, "faded blue bags contain no other bags.\nshiny gold bags contain 1 faded blue bag\n").error_offset == 79);
+    assert(grammar::parse(bag_rules_grammar, "faded blue bags contain 2 shiny gold bugs.\n").error_offset == 38);
     assert(find_bag_colors_containing("shiny gold", rules) == 4);
     assert(bags_inside("shiny gold", rules) == 32);
 
+    auto interned = intern(rules);
+    assert(unintern(interned.view) == rules);
+    bag_rule_index index(interned.view);
+    assert(index.colors_containing("shiny gold") == 4);
+    assert(index.bags_inside("shiny gold") == 32);
+    assert(index.can_contain("light red", "shiny gold") == true);
+    assert(index.can_contain("shiny gold", "light red") == false);
+    assert(answer_query(index, "containing shiny gold") == "4");
+    assert(answer_query(index, "inside shiny gold") == "32");
+    assert(answer_query(index, "contains muted yellow, dotted black") == "yes");
+    assert(answer_query(index, "inside plaid purple") == "unknown color");
+
     const std::string_view input2 =
             "shiny gold bags contain 2 dark red bags.\n"
             "dark red bags contain 2 dark orange bags.\n"
@@ -100,16 +424,75 @@ void test()
             "dark blue bags contain 2 dark violet bags.\n"
             "dark violet bags contain no other bags.\n";
     auto rules2 = read_bag_rules(input2.begin(), input2.end());
+    assert(parse_bag_rules(input2) == rules2);
     assert(bags_inside("shiny gold", rules2) == 126);
+    assert(bag_rule_index(intern(rules2).view).bags_inside("shiny gold") == 126);
 }
 
-int main()
+int main(int argc, char * argv[])
 {
     test();
 
-    std::ifstream in("input/day-07");
-    std::vector<char> input(std::istreambuf_iterator<char> { in }, std::istreambuf_iterator<char> {});
-    auto rules = read_bag_rules(input.begin(), input.end());
-    fmt::print("Bag colors containing shiny gold bag: {}\n", find_bag_colors_containing("shiny gold", rules));
-    fmt::print("Bags inside shiny gold bag: {}\n", bags_inside("shiny gold", rules));
+    options opts(argc, argv);
+    engine_selector engines(opts);
+    perf_report perf(opts);
+    std::string const input_path { opts.value_or("--input", "input/day-07") };
+    if (auto repeats = opts.value("--parse-benchmark")) {
+        std::ifstream in(input_path);
+        std::string const input(std::istreambuf_iterator<char> { in }, std::istreambuf_iterator<char> {});
+        grammar::parse_benchmark(input, std::stoul(std::string { *repeats }),
+                [] (std::string_view text) { return read_bag_rules(text.begin(), text.end()); },
+                [] (std::string_view text) { return parse_bag_rules(text); });
+        return 0;
+    }
+    // The fast engine works on the rules interned as in a snapshot, so with
+    // a snapshot it is used whatever the number of rules
+    auto const snapshot = opts.has("--snapshot");
+    if (snapshot && !engines.use_fast(0, 0) && !engines.verifying())
+        fmt::print(stderr, "--snapshot has no effect with --engine=reference\n");
+    std::optional<loaded_snapshot<bag_graph>> graph;
+    if (snapshot && (engines.use_fast(0, 0) || engines.verifying()))
+        graph.emplace(perf.measure("parse", [&] {
+            return parse_with_snapshot<bag_graph>(input_path,
+                    [] (std::string_view text) { return parse_bag_rules(text); }, save_snapshot, load_bag_graph);
+        }));
+    bag_rules rules;
+    if (!graph || engines.verifying())  // verified against the snapshot
+        rules = perf.measure("parse", [&] {
+            std::ifstream in(input_path);
+            std::vector<char> input(std::istreambuf_iterator<char> { in }, std::istreambuf_iterator<char> {});
+            return engines.run("parse", input.size(), 0,
+                    [&] { return read_bag_rules(input.begin(), input.end()); },
+                    [&] { return parse_bag_rules({ input.data(), input.size() }); });
+        });
+    auto const n_rules = graph ? graph->view.n_colors : rules.size();
+    auto const fast_from = graph ? 0 : 2000;
+    auto interned = [&] () -> bag_graph const & {
+        if (!graph)
+            graph.emplace(intern(rules));
+        return graph->view;
+    };
+    if (opts.has("--serve")) {
+        // Lets std::cin buffer ahead, so that answers can be flushed in batches
+        std::ios::sync_with_stdio(false);
+        serve_queries(perf.measure("index", [&] { return bag_rule_index(interned()); }), std::cin);
+        return 0;
+    }
+    // The fast engine indexes the rules once, for both parts
+    std::optional<bag_rule_index> index;
+    auto indexed = [&] () -> bag_rule_index const & {
+        if (!index)
+            index.emplace(interned());
+        return *index;
+    };
+    fmt::print("Bag colors containing shiny gold bag: {}\n", perf.measure("part 1", [&] {
+        return engines.run("part 1", n_rules, fast_from,
+                [&] { return static_cast<std::size_t>(find_bag_colors_containing("shiny gold", rules)); },
+                [&] { return indexed().colors_containing("shiny gold").value(); });
+    }));
+    fmt::print("Bags inside shiny gold bag: {}\n", perf.measure("part 2", [&] {
+        return engines.run("part 2", n_rules, fast_from,
+                [&] { return bags_inside("shiny gold", rules); },
+                [&] { return indexed().bags_inside("shiny gold").value(); });
+    }));
 }
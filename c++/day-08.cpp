@@ -1,11 +1,33 @@
 // https://adventofcode.com/2020/day/8
 
+#include "engine.h"
+#include "options.h"
+#include "parse.h"
+#include "perf_counters.h"
+#include "pipe_reader.h"
+#include "snapshot.h"
+#include "thread_pool.h"
+#include "timing.h"
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include <fmt/os.h>
+#include <algorithm>
+#include <array>
+#include <atomic>
 #include <cassert>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <fstream>
 #include <iterator>
+#include <limits>
+#include <numeric>
 #include <optional>
+#include <random>
 #include <regex>
 #include <set>
 #include <string>
@@ -40,6 +62,11 @@ struct instruction {
     int arg;
 };
 
+bool operator==(instruction const & lhs, instruction const & rhs)
+{
+    return lhs.op.index() == rhs.op.index() && lhs.arg == rhs.arg;
+}
+
 struct game_console {
     int accumulator = 0;
     std::size_t next_instr = 0;
@@ -68,19 +95,419 @@ bool run(game_console & m, std::vector<instruction> const & instructions)
     return false;
 }
 
-std::optional<int> accumulator_on_termination(std::vector<instruction> const & instructions)
+// Tries the mutations in parallel chunks, skipping those after the first
+// mutation found to terminate, so the result is the same as trying them in
+// order
+std::optional<int> accumulator_on_termination(std::vector<instruction> const & instructions, thread_pool & pool = shared_pool())
 {
-    for (std::size_t i = 0; i < instructions.size(); ++i) {
-        auto & op = instructions[i].op;
-        if (std::holds_alternative<acc>(op))
-            continue;
+    std::atomic<std::size_t> found_at { instructions.size() };
+    return parallel_reduce(pool, 0, instructions.size(), 16, std::optional<int> {}, [&] (std::size_t begin, std::size_t end) -> std::optional<int> {
         auto mutated_instructions = instructions;
-        mutated_instructions[i].op = std::holds_alternative<nop>(op) ? operation { jmp {} } : nop {};
+        for (auto i = begin; i < end && i < found_at; ++i) {
+            auto & op = instructions[i].op;
+            if (std::holds_alternative<acc>(op))
+                continue;
+            mutated_instructions[i].op = std::holds_alternative<nop>(op) ? operation { jmp {} } : nop {};
+            game_console m;
+            auto terminated = run(m, mutated_instructions);
+            mutated_instructions[i].op = op;
+            if (terminated) {
+                fetch_min(found_at, i);
+                return m.accumulator;
+            }
+        }
+        return std::nullopt;
+    }, [] (std::optional<int> lhs, std::optional<int> rhs) { return lhs ? lhs : rhs; });
+}
+
+// Instruction as (operation index, argument) pair
+struct packed_instruction {
+    static constexpr auto acc_op = static_cast<std::int32_t>(operation { acc {} }.index());
+    static constexpr auto jmp_op = static_cast<std::int32_t>(operation { jmp {} }.index());
+    static constexpr auto nop_op = static_cast<std::int32_t>(operation { nop {} }.index());
+
+    std::int32_t op;
+    std::int32_t arg;
+};
+
+packed_instruction pack(instruction const & instr)
+{
+    return { static_cast<std::int32_t>(instr.op.index()), instr.arg };
+}
+
+std::vector<packed_instruction> pack(std::vector<instruction> const & instructions)
+{
+    std::vector<packed_instruction> packed(instructions.size());
+    std::transform(instructions.begin(), instructions.end(), packed.begin(), [] (auto const & instr) { return pack(instr); });
+    return packed;
+}
+
+// Packed program where it is stored, e.g. in a snapshot
+struct program_view {
+    packed_instruction const * code;
+    std::size_t size;
+};
+
+program_view view(std::vector<packed_instruction> const & packed)
+{
+    return { packed.data(), packed.size() };
+}
+
+std::vector<instruction> unpack(program_view program)
+{
+    std::vector<instruction> instructions;
+    instructions.reserve(program.size);
+    for (auto instr = program.code; instr != program.code + program.size; ++instr) {
+        auto op = instr->op == packed_instruction::acc_op ? operation { acc {} }
+                : instr->op == packed_instruction::jmp_op ? operation { jmp {} } : operation { nop {} };
+        instructions.push_back({ op, instr->arg });
+    }
+    return instructions;
+}
+
+// Program compiled to one 64-bit word per instruction: opcode in the low 2
+// bits, the number of instructions covered in bits 2-31 and the (summed)
+// argument in the high 32 bits. Every maximal run of acc/nop instructions is
+// fused into a superinstruction; the word at each position of the run covers
+// the rest of the run, so jumps into the middle of a run stay cheap. Jumps
+// out of the program (other than right after its end) are redirected to a
+// trap past the end, a jmp +0, so they count as not terminating.
+struct bytecode_program {
+public:
+    enum opcode : std::uint64_t { op_acc, op_jmp, op_nop, op_seq };
+
+    explicit bytecode_program(program_view program)
+        : code(program.size + 2)
+    {
+        assert(program.size < (std::size_t { 1 } << 30));
+        auto const trap = static_cast<std::int64_t>(program.size) + 1;
+        code[trap] = encode(op_jmp, 1, 0);
+        std::int64_t run_sum = 0;
+        std::uint64_t run_length = 0;
+        for (auto i = program.size; i-- > 0; ) {
+            auto const & instr = program.code[i];
+            if (instr.op == packed_instruction::jmp_op) {
+                run_sum = run_length = 0;
+                auto const from = static_cast<std::int64_t>(i);
+                auto const target = from + instr.arg;
+                code[i] = encode(op_jmp, 1, target >= 0 && target < trap ? instr.arg : trap - from);
+                continue;
+            }
+            if (instr.op == packed_instruction::acc_op)
+                run_sum += instr.arg;
+            ++run_length;
+            auto op = run_length > 1 ? op_seq : instr.op == packed_instruction::acc_op ? op_acc : op_nop;
+            code[i] = encode(op, run_length, run_sum);
+        }
+    }
+
+    explicit bytecode_program(std::vector<instruction> const & instructions)
+        : bytecode_program(view(pack(instructions)))
+    {
+    }
+
+    std::size_t size() const { return code.size() - 2; }
+    std::size_t code_size() const { return code.size(); }
+    std::uint64_t operator[](std::size_t i) const { return code[i]; }
+
+    static opcode op(std::uint64_t word) { return static_cast<opcode>(word & 3); }
+    static std::size_t length(std::uint64_t word) { return static_cast<std::uint32_t>(word) >> 2; }
+    static int arg(std::uint64_t word) { return static_cast<std::int32_t>(word >> 32); }
+
+private:
+    static std::uint64_t encode(opcode op, std::uint64_t length, std::int64_t arg)
+    {
+        assert(arg >= std::numeric_limits<std::int32_t>::min() && arg <= std::numeric_limits<std::int32_t>::max());
+        return op | length << 2 | static_cast<std::uint64_t>(static_cast<std::uint32_t>(arg)) << 32;
+    }
+
+    std::vector<std::uint64_t> code;
+};
+
+struct run_result {
+    bool terminated;
+    int accumulator;
+};
+
+// Runs until normal termination or until an instruction is about to be
+// executed a second time. Since a run is always executed from its entry
+// point to its end, the executed positions of a run form a suffix of it, so
+// it suffices to track the first executed position per run (stored at the
+// position of the run's last instruction).
+run_result run(bytecode_program const & program)
+{
+    struct state {
+        int accumulator = 0;
+        std::size_t next_instr = 0;
+    };
+    using handler = void (*)(state &, std::uint64_t);
+    static constexpr std::array<handler, 4> handlers {
+        [] (state & s, std::uint64_t word) { s.accumulator += bytecode_program::arg(word); ++s.next_instr; },  // acc
+        [] (state & s, std::uint64_t word) { s.next_instr += bytecode_program::arg(word); },                // jmp
+        [] (state & s, std::uint64_t) { ++s.next_instr; },                                                   // nop
+        [] (state & s, std::uint64_t word) {                                                                 // seq
+            s.accumulator += bytecode_program::arg(word);
+            s.next_instr += bytecode_program::length(word);
+        } };
+
+    constexpr auto not_executed = std::numeric_limits<std::uint32_t>::max();
+    std::vector<std::uint32_t> first_executed(program.code_size(), not_executed);
+    state s;
+    while (s.next_instr != program.size()) {
+        assert(s.next_instr < program.code_size());
+        auto word = program[s.next_instr];
+        auto & first = first_executed[s.next_instr + bytecode_program::length(word) - 1];
+        if (first <= s.next_instr)
+            return { false, s.accumulator };
+        if (first != not_executed)  // stop where the executed suffix begins
+            return { false, s.accumulator + bytecode_program::arg(word) - bytecode_program::arg(program[first]) };
+        first = s.next_instr;
+        handlers[bytecode_program::op(word)](s, word);
+    }
+    return { true, s.accumulator };
+}
+
+// A program run by run_batch, possibly with one instruction swapped between
+// jmp and nop, so the mutations of a program need no copies of it
+struct batch_job {
+    static constexpr auto no_flip = std::numeric_limits<std::uint32_t>::max();
+
+    std::uint32_t program;
+    std::uint32_t flipped = no_flip;
+};
+
+// Programs packed one after the other, for run_batch
+struct packed_programs {
+public:
+    explicit packed_programs(std::vector<std::vector<instruction>> const & programs, thread_pool & pool = shared_pool())
+        : offsets { 0 }
+    {
+        for (auto const & program: programs)
+            offsets.push_back(offsets.back() + program.size());
+        packed.resize(offsets.back());
+        pool.parallel_for(0, programs.size(), 4096, [&] (std::size_t begin, std::size_t end) {
+            for (auto i = begin; i < end; ++i)
+                std::transform(programs[i].begin(), programs[i].end(), packed.begin() + offsets[i], [] (auto const & instr) { return pack(instr); });
+        });
+        code = packed.data();
+    }
+
+    // A single program used where it is, without copying
+    explicit packed_programs(program_view program)
+        : code(program.code), offsets { 0, program.size }
+    {
+    }
+
+    packed_programs(packed_programs const &) = delete;
+    packed_programs & operator=(packed_programs const &) = delete;
+
+    std::size_t size() const { return offsets.size() - 1; }
+    packed_instruction const * program(std::size_t i) const { return code + offsets[i]; }
+    std::size_t program_size(std::size_t i) const { return offsets[i + 1] - offsets[i]; }
+
+private:
+    std::vector<packed_instruction> packed;
+    packed_instruction const * code;
+    std::vector<std::size_t> offsets;
+};
+
+// Runs many programs side by side until each terminates or repeats an
+// instruction. The jobs are split into chunks run in parallel. A chunk keeps
+// the registers of up to 256 programs (lanes) in arrays and steps them in
+// lockstep, one instruction each per round; each lane marks the instructions
+// executed in its own bitmap, carved out of one allocation for the chunk. A
+// finished program is retired and its lane takes the next job of the chunk,
+// or leaves the active set if there is none.
+std::vector<run_result> run_batch(packed_programs const & programs, std::vector<batch_job> const & jobs, thread_pool & pool = shared_pool())
+{
+    constexpr auto acc_op = packed_instruction::acc_op;
+    constexpr auto jmp_op = packed_instruction::jmp_op;
+    constexpr auto nop_op = packed_instruction::nop_op;
+    std::vector<run_result> results(jobs.size());
+    // Lanes of programs in lockstep per chunk, limited so the bitmaps stay small
+    std::size_t max_words = 1;
+    for (std::size_t i = 0; i < programs.size(); ++i)
+        max_words = std::max(max_words, (programs.program_size(i) + 63) / 64);
+    auto max_lanes = std::clamp<std::size_t>((std::size_t { 1 } << 16) / max_words, 1, 256);
+
+    pool.parallel_for(0, jobs.size(), 1024, [&] (std::size_t begin, std::size_t end) {
+        auto n_lanes = std::min(max_lanes, end - begin);
+        std::vector<std::size_t> lane_jobs(n_lanes);
+        std::vector<packed_instruction const *> lane_programs(n_lanes);
+        std::vector<std::size_t> lane_sizes(n_lanes);
+        std::vector<std::size_t> lane_flipped(n_lanes);
+        std::vector<std::size_t> pcs(n_lanes);
+        std::vector<int> accumulators(n_lanes);
+        std::vector<std::uint64_t> visited(n_lanes * max_words);
+        auto next_job = begin;
+        auto start_job = [&] (std::size_t lane) {
+            auto const & job = jobs[next_job];
+            lane_jobs[lane] = next_job++;
+            lane_programs[lane] = programs.program(job.program);
+            lane_sizes[lane] = programs.program_size(job.program);
+            lane_flipped[lane] = job.flipped;
+            pcs[lane] = 0;
+            accumulators[lane] = 0;
+            std::fill_n(visited.begin() + lane * max_words, (lane_sizes[lane] + 63) / 64, 0);
+        };
+        std::vector<std::uint32_t> active(n_lanes);
+        std::iota(active.begin(), active.end(), 0);
+        for (auto lane: active)
+            start_job(lane);
+
+        while (!active.empty())
+            for (std::size_t a = 0; a < active.size(); ) {
+                auto lane = active[a];
+                auto program = lane_programs[lane];
+                auto program_size = lane_sizes[lane];
+                auto pc = pcs[lane];
+                // A jump out of the program (other than right after its end) counts as not terminating
+                auto word = pc < program_size ? &visited[lane * max_words + pc / 64] : nullptr;
+                auto bit = std::uint64_t { 1 } << (pc % 64);
+                if (!word || (*word & bit)) {
+                    results[lane_jobs[lane]] = { pc == program_size, accumulators[lane] };
+                    if (next_job < end) {
+                        start_job(lane);
+                        ++a;
+                    }
+                    else {
+                        active[a] = active.back();
+                        active.pop_back();
+                    }
+                    continue;
+                }
+                *word |= bit;
+                auto op = program[pc].op;
+                if (pc == lane_flipped[lane])
+                    op = op == jmp_op ? nop_op : jmp_op;
+                accumulators[lane] += op == acc_op ? program[pc].arg : 0;
+                pcs[lane] = pc + (op == jmp_op ? program[pc].arg : 1);
+                ++a;
+            }
+    });
+    return results;
+}
+
+// Same as accumulator_on_termination, running all mutations as one batch
+std::optional<int> accumulator_on_termination_batched(program_view program, thread_pool & pool = shared_pool())
+{
+    std::vector<batch_job> jobs;
+    for (std::size_t i = 0; i < program.size; ++i)
+        if (program.code[i].op != packed_instruction::acc_op)
+            jobs.push_back({ 0, static_cast<std::uint32_t>(i) });
+    auto results = run_batch(packed_programs(program), jobs, pool);
+    auto it = std::find_if(results.begin(), results.end(), [] (auto const & r) { return r.terminated; });
+    if (it == results.end())
+        return std::nullopt;
+    return it->accumulator;
+}
+
+std::optional<int> accumulator_on_termination_batched(std::vector<instruction> const & instructions, thread_pool & pool = shared_pool())
+{
+    return accumulator_on_termination_batched(view(pack(instructions)), pool);
+}
+
+std::vector<instruction> generate_long_program(std::size_t size)
+{
+    std::mt19937 gen;
+    std::uniform_int_distribution<int> op_dist(0, 9);
+    std::uniform_int_distribution<int> arg_dist(-100, 100);
+    std::uniform_int_distribution<int> jump_dist(1, 8);
+    std::vector<instruction> instructions;
+    instructions.reserve(size);
+    for (std::size_t i = 0; i < size; ++i) {
+        auto op = op_dist(gen);
+        if (op < 6)
+            instructions.push_back({ acc {}, arg_dist(gen) });
+        else if (op < 8 || i + 8 >= size)
+            instructions.push_back({ nop {}, arg_dist(gen) });
+        else
+            instructions.push_back({ jmp {}, jump_dist(gen) });  // forward only, so it terminates
+    }
+    return instructions;
+}
+
+void benchmark(std::size_t size)
+{
+    auto instructions = generate_long_program(size);
+
+    auto start = std::chrono::steady_clock::now();
+    game_console m;
+    auto terminated = run(m, instructions);
+    auto reference_time = seconds_since(start);
+    auto steps = m.instructions_executed.size();
+
+    start = std::chrono::steady_clock::now();
+    bytecode_program program(instructions);
+    auto compile_time = seconds_since(start);
+    start = std::chrono::steady_clock::now();
+    auto result = run(program);
+    auto bytecode_time = seconds_since(start);
+    assert(result.terminated == terminated && result.accumulator == m.accumulator);
+
+    fmt::print("Program size: {}, instructions executed: {}\n", size, steps);
+    fmt::print("Reference interpreter: {:.3e} instructions/s\n", steps / reference_time);
+    fmt::print("Bytecode interpreter: {:.3e} instructions/s ({:.3e} including compilation)\n",
+            steps / bytecode_time, steps / (bytecode_time + compile_time));
+}
+
+// Short random programs, some looping and some terminating
+std::vector<std::vector<instruction>> generate_short_programs(std::size_t n_programs)
+{
+    std::mt19937 gen;
+    std::uniform_int_distribution<std::size_t> size_dist(16, 64);
+    std::uniform_int_distribution<int> op_dist(0, 9);
+    std::uniform_int_distribution<int> arg_dist(-100, 100);
+    std::vector<std::vector<instruction>> programs(n_programs);
+    for (auto & instructions: programs) {
+        auto size = size_dist(gen);
+        for (std::size_t i = 0; i < size; ++i) {
+            auto op = op_dist(gen);
+            if (op < 5)
+                instructions.push_back({ acc {}, arg_dist(gen) });
+            else if (op < 8)
+                instructions.push_back({ nop {}, arg_dist(gen) });
+            else {
+                // Stays within the program or jumps right after its end
+                auto target = std::uniform_int_distribution<std::size_t>(0, size)(gen);
+                instructions.push_back({ jmp {}, static_cast<int>(target) - static_cast<int>(i) });
+            }
+        }
+    }
+    return programs;
+}
+
+void batch_benchmark(std::size_t n_programs)
+{
+    auto programs = generate_short_programs(n_programs);
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<run_result> expected;
+    for (auto const & instructions: programs) {
         game_console m;
-        if (run(m, mutated_instructions))
-            return m.accumulator;
+        auto terminated = run(m, instructions);
+        expected.push_back({ terminated, m.accumulator });
     }
-    return std::nullopt;
+    auto reference_time = seconds_since(start);
+
+    std::vector<batch_job> jobs;
+    for (std::size_t i = 0; i < programs.size(); ++i)
+        jobs.push_back({ static_cast<std::uint32_t>(i) });
+    start = std::chrono::steady_clock::now();
+    packed_programs packed(programs);
+    auto pack_time = seconds_since(start);
+    start = std::chrono::steady_clock::now();
+    auto results = run_batch(packed, jobs);
+    auto batch_time = seconds_since(start);
+    assert(std::equal(results.begin(), results.end(), expected.begin(), [] (auto const & lhs, auto const & rhs) {
+        return lhs.terminated == rhs.terminated && lhs.accumulator == rhs.accumulator;
+    }));
+
+    auto n_terminated = std::count_if(results.begin(), results.end(), [] (auto const & r) { return r.terminated; });
+    fmt::print("Programs: {}, terminating: {}\n", n_programs, n_terminated);
+    fmt::print("One console at a time: {:.3e} programs/s\n", n_programs / reference_time);
+    fmt::print("Batch ({} threads): {:.3e} programs/s ({:.3e} including packing)\n",
+            shared_pool().size(), n_programs / batch_time, n_programs / (batch_time + pack_time));
 }
 
 template <typename It>
@@ -103,6 +530,54 @@ std::vector<instruction> read_instructions(It begin, It end)
     return instructions;
 }
 
+constexpr auto instructions_grammar = [] {
+    using namespace grammar;
+    constexpr auto op = map(lit("acc"), [] { return operation { acc {} }; })
+            | map(lit("jmp"), [] { return operation { jmp {} }; })
+            | map(lit("nop"), [] { return operation { nop {} }; });
+    constexpr auto instr = map(op >> lit(" ") >> integer<int> >> (lit("\n") | end), [] (operation op, int arg) { return instruction { op, arg }; });
+    return many(instr);
+}();
+
+// Same as read_instructions, with a parser combinator grammar instead of regular expressions
+std::vector<instruction> parse_instructions(std::string_view input)
+{
+    return grammar::parse_or_exit(instructions_grammar, input, "instructions");
+}
+
+// Parses the blocks of whole lines of the reader as they arrive
+std::vector<instruction> parse_instructions(pipe_reader & reader)
+{
+    std::vector<instruction> instructions;
+    std::size_t offset = 0;
+    reader.for_each_block("\n", [&] (std::string_view block) {
+        auto result = grammar::parse(instructions_grammar, block);
+        if (!result.value) {
+            fmt::print(stderr, "Malformed instructions at byte offset {}\n", offset + result.error_offset);
+            std::exit(EXIT_FAILURE);
+        }
+        instructions.insert(instructions.end(), result.value->begin(), result.value->end());
+        offset += block.size();
+    });
+    return instructions;
+}
+
+void save_snapshot(snapshot_writer & w, std::vector<instruction> const & instructions)
+{
+    auto packed = pack(instructions);
+    w.write(std::uint64_t { packed.size() });
+    w.write_array(packed.data(), packed.size());
+}
+
+std::optional<program_view> load_program(snapshot_reader & r)
+{
+    auto n = r.read_size();
+    auto code = r.read_array<packed_instruction>(n);
+    if (!code || !std::all_of(code, code + n, [] (auto const & instr) { return instr.op >= 0 && instr.op < static_cast<std::int32_t>(std::variant_size_v<operation>); }))
+        return std::nullopt;
+    return program_view { code, n };
+}
+
 void test()
 {
     const std::string_view input =
@@ -116,25 +591,237 @@ void test()
             "jmp -4\n"
             "acc +6\n";
     auto instructions = read_instructions(input.begin(), input.end());
+    assert(parse_instructions(input) == instructions);
+    assert(parse_instructions("acc -7") == (std::vector<instruction> { { acc {}, -7 } }));
+    assert(grammar::parse(instructions_grammar, "nop +0\njmp 4x\n").error_offset == 12);
+    assert(grammar::parse(instructions_grammar, "nop +0\nacc +99999999999\n").error_offset == 21);
 
     game_console m;
     run_until_loop_detection(m, instructions);
     assert(m.accumulator == 5);
 
     assert(accumulator_on_termination(instructions) == 8);
+    thread_pool pool(3);
+    assert(accumulator_on_termination(instructions, pool) == 8);
+    assert(accumulator_on_termination_batched(instructions, pool) == 8);
+
+    const std::string_view terminating_input =
+            "acc +2\n"
+            "jmp +2\n"
+            "acc +5\n"
+            "nop +0\n";
+    auto batch = run_batch(packed_programs({ instructions, read_instructions(terminating_input.begin(), terminating_input.end()) }, pool),
+            { { 0 }, { 1 }, { 0, 7 }, { 0, 0 } }, pool);
+    assert(!batch[0].terminated && batch[0].accumulator == 5);
+    assert(batch[1].terminated && batch[1].accumulator == 2);
+    assert(batch[2].terminated && batch[2].accumulator == 8);
+    assert(!batch[3].terminated && batch[3].accumulator == 0);
+    auto programs = generate_short_programs(3000);
+    std::vector<batch_job> jobs;
+    for (std::size_t i = 0; i < programs.size(); ++i)
+        jobs.push_back({ static_cast<std::uint32_t>(i) });
+    batch = run_batch(packed_programs(programs, pool), jobs, pool);
+    for (std::size_t i = 0; i < programs.size(); ++i) {
+        game_console m2;
+        auto terminated = run(m2, programs[i]);
+        assert(batch[i].terminated == terminated && batch[i].accumulator == m2.accumulator);
+    }
+
+    auto result = run(bytecode_program(instructions));
+    assert(!result.terminated && result.accumulator == 5);
+
+    // Jumps into the middle of runs executed before
+    const std::string_view input2 =
+            "acc +1\n"
+            "acc +2\n"
+            "acc +4\n"
+            "jmp -2\n";
+    auto instructions2 = read_instructions(input2.begin(), input2.end());
+    result = run(bytecode_program(instructions2));
+    assert(!result.terminated && result.accumulator == 7);
+    const std::string_view input3 =
+            "jmp +2\n"
+            "acc +1\n"
+            "acc +2\n"
+            "acc +4\n"
+            "jmp -3\n";
+    auto instructions3 = read_instructions(input3.begin(), input3.end());
+    result = run(bytecode_program(instructions3));
+    assert(!result.terminated && result.accumulator == 7);
+
+    // Jumps out of the program stop without terminating, as in run_batch
+    const std::string_view input4 =
+            "acc +1\n"
+            "jmp +3\n"
+            "acc +2\n";
+    auto instructions4 = read_instructions(input4.begin(), input4.end());
+    result = run(bytecode_program(instructions4));
+    assert(!result.terminated && result.accumulator == 1);
+    instructions4[1].arg = -2;
+    result = run(bytecode_program(instructions4));
+    assert(!result.terminated && result.accumulator == 1);
+    instructions4[1].arg = 2;
+    result = run(bytecode_program(instructions4));
+    assert(result.terminated && result.accumulator == 1);
+
+    auto long_program = generate_long_program(10000);
+    game_console m2;
+    auto terminated = run(m2, long_program);
+    result = run(bytecode_program(long_program));
+    assert(terminated && result.terminated && result.accumulator == m2.accumulator);
+
+    auto packed = pack(instructions);
+    assert(unpack(view(packed)) == instructions);
+    result = run(bytecode_program(view(packed)));
+    assert(!result.terminated && result.accumulator == 5);
+    assert(accumulator_on_termination_batched(view(packed), pool) == 8);
+}
+
+// Tests that need files, run by "--self-test" rather than on every run
+void self_test()
+{
+    // Snapshots are used instead of parsing while they match the input, and
+    // parsing takes over when they are stale or corrupt
+    const std::string_view input =
+            "nop +0\n"
+            "acc +1\n"
+            "jmp +4\n"
+            "acc +3\n"
+            "jmp -3\n"
+            "acc -99\n"
+            "acc +1\n"
+            "jmp -4\n"
+            "acc +6\n";
+    std::string const path = "day-08-self-test.input";
+    auto const snapshot_path = path + ".snapshot";
+    std::remove(snapshot_path.c_str());
+    auto write_input = [&] (std::string_view text) {
+        std::ofstream out(path, std::ios::binary | std::ios::trunc);
+        out << text;
+        if (!out.flush()) {
+            fmt::print(stderr, "Cannot write {}\n", path);
+            std::exit(EXIT_FAILURE);
+        }
+    };
+    std::size_t n_parsed = 0;
+    auto parse_snapshotted = [&] {
+        auto snapshot = parse_with_snapshot<program_view>(path, [&] (std::string_view text) {
+            ++n_parsed;
+            return parse_instructions(text);
+        }, save_snapshot, load_program);
+        return unpack(snapshot.view);
+    };
+    write_input(input);
+    auto const instructions = read_instructions(input.begin(), input.end());
+    assert(parse_snapshotted() == instructions && n_parsed == 1);
+    assert(parse_snapshotted() == instructions && n_parsed == 1);
+    // Touched without a change, the content is hashed but not parsed
+    auto touched = utimensat(AT_FDCWD, path.c_str(), nullptr, 0);
+    assert(touched == 0);
+    assert(parse_snapshotted() == instructions && n_parsed == 1);
+    assert(parse_snapshotted() == instructions && n_parsed == 1);
+    auto const changed_input = std::string { input } + "acc +2\n";
+    write_input(changed_input);
+    auto changed = parse_snapshotted();
+    assert(changed.size() == instructions.size() + 1 && n_parsed == 2);
+    assert(parse_snapshotted() == changed && n_parsed == 2);
+    auto fd = open(snapshot_path.c_str(), O_RDWR);
+    if (fd < 0) {
+        fmt::print(stderr, "Cannot open {}: {}\n", snapshot_path, std::strerror(errno));
+        std::exit(EXIT_FAILURE);
+    }
+    auto const snapshot_size = lseek(fd, 0, SEEK_END);
+    char last = 0;
+    auto n = pread(fd, &last, 1, snapshot_size - 1);
+    assert(n == 1);
+    last ^= 1;
+    n = pwrite(fd, &last, 1, snapshot_size - 1);
+    assert(n == 1);
+    close(fd);
+    assert(parse_snapshotted() == changed && n_parsed == 3);
+    assert(parse_snapshotted() == changed && n_parsed == 3);
+    auto truncated = truncate(snapshot_path.c_str(), snapshot_size - 1);
+    assert(truncated == 0);
+    assert(parse_snapshotted() == changed && n_parsed == 4);
+    // No snapshot without an input file
+    std::remove(path.c_str());
+    std::remove(snapshot_path.c_str());
+    assert(parse_snapshotted().empty() && n_parsed == 5);
+    assert(access(snapshot_path.c_str(), F_OK) != 0);
 }
 
-int main()
+int main(int argc, char * argv[])
 {
     test();
 
-    std::ifstream in("input/day-08");
-    std::vector<char> input(std::istreambuf_iterator<char> { in }, std::istreambuf_iterator<char> {});
-    auto instructions = read_instructions(input.begin(), input.end());
+    options opts(argc, argv);
+    if (opts.has("--self-test")) {
+        self_test();
+        return 0;
+    }
+    perf_report perf(opts);
+    configure_shared_pool(opts);
+    engine_selector engines(opts);
+    if (auto size = opts.value("--benchmark")) {
+        benchmark(std::stoul(std::string { *size }));
+        return 0;
+    }
+    if (auto n_programs = opts.value("--batch-benchmark")) {
+        batch_benchmark(std::stoul(std::string { *n_programs }));
+        return 0;
+    }
 
-    game_console m;
-    run_until_loop_detection(m, instructions);
-    fmt::print("Accumulator on loop detection: {}\n", m.accumulator);
+    std::string const input_path { opts.value_or("--input", "input/day-08") };
+    if (auto repeats = opts.value("--parse-benchmark")) {
+        std::ifstream in(input_path);
+        std::string const input(std::istreambuf_iterator<char> { in }, std::istreambuf_iterator<char> {});
+        grammar::parse_benchmark(input, std::stoul(std::string { *repeats }),
+                [] (std::string_view text) { return read_instructions(text.begin(), text.end()); },
+                [] (std::string_view text) { return parse_instructions(text); });
+        return 0;
+    }
+    // The snapshot holds the program packed as the fast engines run it, so
+    // with it they are used whatever the program size
+    auto const snapshot = opts.has("--snapshot") && !opts.has("--stdin");
+    if (snapshot && !engines.use_fast(0, 0) && !engines.verifying())
+        fmt::print(stderr, "--snapshot has no effect with --engine=reference\n");
+    std::optional<loaded_snapshot<program_view>> snapshotted;
+    if (snapshot && (engines.use_fast(0, 0) || engines.verifying()))
+        snapshotted.emplace(perf.measure("parse", [&] {
+            return parse_with_snapshot<program_view>(input_path,
+                    [] (std::string_view text) { return parse_instructions(text); }, save_snapshot, load_program);
+        }));
+    std::vector<instruction> instructions;
+    if (opts.has("--stdin"))
+        instructions = perf.measure("read+parse", [&] {
+            pipe_reader reader(STDIN_FILENO, opts);
+            return parse_instructions(reader);
+        });
+    else if (!snapshotted || engines.verifying())  // verified against the snapshot
+        instructions = perf.measure("parse", [&] {
+            std::ifstream in(input_path);
+            std::vector<char> input(std::istreambuf_iterator<char> { in }, std::istreambuf_iterator<char> {});
+            return engines.run("parse", input.size(), 0,
+                    [&] { return read_instructions(input.begin(), input.end()); },
+                    [&] { return parse_instructions({ input.data(), input.size() }); });
+        });
+    auto const program_size = snapshotted ? snapshotted->view.size : instructions.size();
+
+    fmt::print("Accumulator on loop detection: {}\n", perf.measure("part 1", [&] {
+        return engines.run("part 1", program_size, snapshotted ? 0 : 1 << 12, [&] {
+            game_console m;
+            run_until_loop_detection(m, instructions);
+            return m.accumulator;
+        }, [&] {
+            auto result = run(snapshotted ? bytecode_program(snapshotted->view) : bytecode_program(instructions));
+            assert(!result.terminated);
+            return result.accumulator;
+        });
+    }));
 
-    fmt::print("Accumulator on normal termination: {}\n", accumulator_on_termination(instructions).value());
+    fmt::print("Accumulator on normal termination: {}\n", perf.measure("part 2", [&] {
+        return engines.run("part 2", program_size, snapshotted ? 0 : 256,
+                [&] { return accumulator_on_termination(instructions, sequential_pool()); },
+                [&] { return snapshotted ? accumulator_on_termination_batched(snapshotted->view) : accumulator_on_termination_batched(instructions); });
+    }).value());
 }
@@ -1,26 +1,36 @@
 // https://adventofcode.com/2020/day/9
 
+#include "engine.h"
+#include "flat_hash.h"
+#include "options.h"
+#include "perf_counters.h"
+#include "pipe_reader.h"
+#include "thread_pool.h"
 #include <fmt/os.h>
 #include <gsl/span>
 #include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <cctype>
+#include <charconv>
 #include <cstdint>
 #include <cstdlib>
 #include <fstream>
 #include <iterator>
+#include <limits>
 #include <optional>
-#include <unordered_map>
-#include <unordered_set>
+#include <string>
+#include <string_view>
 #include <utility>
 #include <vector>
 
 using int_t = std::uint64_t;
 
-std::optional<std::pair<int_t, int_t>> find_addend_pair(gsl::span<const int_t> numbers, int_t sum, std::unordered_set<int_t> & observed)
+std::optional<std::pair<int_t, int_t>> find_addend_pair(gsl::span<const int_t> numbers, int_t sum, flat_hash_set<int_t> & observed)
 {
     for (auto a: numbers) {
         auto i = sum - a;
-        if (observed.count(i) && i != a)
+        if (observed.contains(i) && i != a)
             return std::pair { i, a };
         else
             observed.insert(a);
@@ -30,7 +40,7 @@ std::optional<std::pair<int_t, int_t>> find_addend_pair(gsl::span<const int_t> n
 
 std::optional<int_t> find_invalid_number(gsl::span<const int_t> numbers, std::size_t preamble_size)
 {
-    std::unordered_set<int_t> seen_in_preamble;
+    flat_hash_set<int_t> seen_in_preamble(preamble_size);
     assert(numbers.size() > preamble_size);
     for (std::size_t i = preamble_size; i < numbers.size(); ++i) {
         if (!find_addend_pair(numbers.subspan(i - preamble_size, preamble_size), numbers[i], seen_in_preamble).has_value())
@@ -41,18 +51,91 @@ std::optional<int_t> find_invalid_number(gsl::span<const int_t> numbers, std::si
     return std::nullopt;
 }
 
+// True if two different numbers in the window sum up to n. Tests all pairs
+// without data dependent branches in the inner loop, so it can be vectorized.
+bool is_pair_sum(gsl::span<const int_t> window, int_t n)
+{
+    for (std::size_t j = 0; j < window.size(); ++j) {
+        auto a = window[j];
+        bool found = false;
+        for (std::size_t k = 0; k < window.size(); ++k)
+            found |= (a + window[k] == n) & (a != window[k]);
+        if (found)
+            return true;
+    }
+    return false;
+}
+
+// Validates every position independently, split into blocks handed out to
+// the pool threads in increasing order. Returns the indices of all invalid
+// numbers, or only of the first one if first_only is set.
+std::vector<std::size_t> find_invalid_indices(gsl::span<const int_t> numbers, std::size_t preamble_size,
+        bool first_only, thread_pool & pool = shared_pool())
+{
+    constexpr std::size_t block_size = 4096;
+    constexpr auto none = std::numeric_limits<std::size_t>::max();
+    assert(numbers.size() > preamble_size);
+    auto n_blocks = (numbers.size() - preamble_size + block_size - 1) / block_size;
+    std::atomic<std::size_t> next_block { 0 };
+    std::atomic<std::size_t> first_invalid { none };
+    std::vector<std::vector<std::size_t>> invalid_per_block(n_blocks);
+
+    auto worker = [&] {
+        for (auto b = next_block++; b < n_blocks; b = next_block++) {
+            auto begin = preamble_size + b * block_size;
+            auto end = std::min(begin + block_size, numbers.size());
+            if (first_only && begin > first_invalid)
+                return;
+            for (auto i = begin; i < end; ++i)
+                if (!is_pair_sum(numbers.subspan(i - preamble_size, preamble_size), numbers[i])) {
+                    invalid_per_block[b].push_back(i);
+                    if (first_only) {
+                        fetch_min(first_invalid, i);
+                        break;
+                    }
+                }
+        }
+    };
+    // One lane per pool thread, each pulling the next block
+    pool.parallel_for(0, std::min<std::size_t>(pool.size(), n_blocks), 1, [&] (std::size_t, std::size_t) { worker(); });
+
+    std::vector<std::size_t> invalid;
+    for (auto const & block_invalid: invalid_per_block)
+        invalid.insert(invalid.end(), block_invalid.begin(), block_invalid.end());
+    if (first_only && !invalid.empty())
+        invalid.resize(1);
+    return invalid;
+}
+
+// Finds the contiguous range of at least two numbers summing up to sum that ends first
 std::optional<gsl::span<const int_t>> find_sub_array(gsl::span<const int_t> numbers, int_t sum)
 {
-    std::unordered_map<int_t, std::size_t> prefix_sums;
+    flat_hash_map<int_t, std::size_t> prefix_sums(numbers.size());
     int_t curr_sum = 0;
     for (std::size_t i = 0; i < numbers.size(); i++) {
         curr_sum += numbers[i];
-        if (curr_sum == sum)
-            return numbers.first(i);
-        else if (auto it = prefix_sums.find(curr_sum - sum); it != prefix_sums.end())
-            return numbers.subspan(it->second + 1, i - it->second);
-        else
-            prefix_sums.emplace(curr_sum, i);
+        if (curr_sum == sum && i > 0)
+            return numbers.first(i + 1);
+        else if (auto j = prefix_sums.find(curr_sum - sum); j && *j + 1 < i)
+            return numbers.subspan(*j + 1, i - *j);
+        prefix_sums.try_emplace(curr_sum, i);
+    }
+    return std::nullopt;
+}
+
+// Same as find_sub_array for positive numbers, with a sliding window instead
+// of a hash map of the prefix sums
+std::optional<gsl::span<const int_t>> find_sub_array_sliding(gsl::span<const int_t> numbers, int_t sum)
+{
+    std::size_t begin = 0;
+    int_t window_sum = 0;
+    for (std::size_t end = 0; end < numbers.size(); ++end) {
+        assert(numbers[end] > 0);
+        window_sum += numbers[end];
+        while (window_sum > sum && begin <= end)
+            window_sum -= numbers[begin++];
+        if (window_sum == sum && end > begin)
+            return numbers.subspan(begin, end - begin + 1);
     }
     return std::nullopt;
 }
@@ -63,21 +146,96 @@ int_t smallest_largest_sum(gsl::span<const int_t> numbers)
     return *std::min_element(numbers.begin(), numbers.end()) + *std::max_element(numbers.begin(), numbers.end());
 }
 
+// Appends the whitespace separated numbers of text
+void append_numbers(std::string_view text, std::vector<int_t> & numbers)
+{
+    auto it = text.data();
+    auto const end = it + text.size();
+    while (true) {
+        while (it != end && std::isspace(static_cast<unsigned char>(*it)))
+            ++it;
+        if (it == end)
+            break;
+        int_t n;
+        auto [next, ec] = std::from_chars(it, end, n);
+        if (ec != std::errc {}) {
+            fmt::print(stderr, "Malformed number in input\n");
+            std::exit(EXIT_FAILURE);
+        }
+        numbers.push_back(n);
+        it = next;
+    }
+}
+
 void test()
 {
     int_t const numbers[] = { 35, 20, 15, 25, 47, 40, 62, 55, 65, 95, 102, 117, 150, 182, 127, 219, 299, 277, 309, 576 };
     auto invalid_number = find_invalid_number(numbers, 5).value();
     assert(invalid_number == 127);
+    thread_pool pool(3);
+    assert(find_invalid_indices(numbers, 5, true, pool) == std::vector<std::size_t> { 14 });
+    assert(find_invalid_indices(numbers, 5, false, pool) == std::vector<std::size_t> { 14 });
+    int_t const numbers2[] = { 1, 2, 3, 5, 9, 14, 23, 37, 50, 87 };
+    assert(find_invalid_indices(numbers2, 2, false, pool) == (std::vector<std::size_t> { 4, 8 }));
+    assert(find_invalid_indices(numbers2, 2, true, pool) == std::vector<std::size_t> { 4 });
+    int_t const numbers3[] = { 3, 3, 6 };
+    assert(find_invalid_indices(numbers3, 2, true, pool) == std::vector<std::size_t> { 2 });
+    // Fibonacci numbers (modulo 2^64) with two of them broken, spanning several blocks
+    std::vector<int_t> many_numbers { 1, 2 };
+    while (many_numbers.size() < 20000)
+        many_numbers.push_back(many_numbers.end()[-1] + many_numbers.end()[-2]);
+    ++many_numbers[10000];
+    ++many_numbers[15000];
+    std::vector<std::size_t> expected_invalid;
+    for (std::size_t i = 2; i < many_numbers.size(); ++i)
+        if (!is_pair_sum(gsl::span<const int_t>(many_numbers).subspan(i - 2, 2), many_numbers[i]))
+            expected_invalid.push_back(i);
+    assert(expected_invalid.front() == 10000);
+    assert(find_invalid_indices(many_numbers, 2, false, pool) == expected_invalid);
+    assert(find_invalid_indices(many_numbers, 2, true, pool) == std::vector<std::size_t> { 10000 });
     assert(smallest_largest_sum(find_sub_array(numbers, invalid_number).value()) == 62);
+    assert(smallest_largest_sum(find_sub_array_sliding(numbers, invalid_number).value()) == 62);
+    int_t const numbers4[] = { 5, 4, 3, 9, 2 };
+    assert(find_sub_array(numbers4, 9)->size() == 2 && find_sub_array_sliding(numbers4, 9)->size() == 2);
+    assert(find_sub_array(numbers4, 12)->size() == 3 && find_sub_array_sliding(numbers4, 12)->size() == 3);
+    assert(!find_sub_array(numbers4, 2) && !find_sub_array_sliding(numbers4, 2));
 }
 
-int main()
+int main(int argc, char * argv[])
 {
     test();
 
-    std::ifstream in("input/day-09");
-    std::vector<int_t> input(std::istream_iterator<int_t> { in }, std::istream_iterator<int_t> {});
-    auto invalid_number = find_invalid_number(input, 25).value();
+    options opts(argc, argv);
+    perf_report perf(opts);
+    configure_shared_pool(opts);
+    engine_selector engines(opts);
+    auto const input = opts.has("--stdin") ? perf.measure("read+parse", [&] {
+        // Blocks of whole lines are parsed while the next ones are being read
+        std::vector<int_t> numbers;
+        pipe_reader reader(STDIN_FILENO, opts);
+        reader.for_each_block("\n", [&] (std::string_view block) { append_numbers(block, numbers); });
+        return numbers;
+    }) : perf.measure("parse", [&] {
+        std::ifstream in(std::string { opts.value_or("--input", "input/day-09") });
+        return std::vector<int_t>(std::istream_iterator<int_t> { in }, std::istream_iterator<int_t> {});
+    });
+    auto preamble_size = std::stoul(std::string { opts.value_or("--preamble", "25") });
+
+    if (opts.has("--all-invalid")) {
+        for (auto i: find_invalid_indices(input, preamble_size, false))
+            fmt::print("{}: {}\n", i, input[i]);
+        return 0;
+    }
+
+    auto invalid_number = perf.measure("part 1", [&] {
+        return engines.run("part 1", input.size(), 1 << 13,
+                [&] { return find_invalid_number(input, preamble_size).value(); },
+                [&] { return input.at(find_invalid_indices(input, preamble_size, true).at(0)); });
+    });
     fmt::print("Invalid number: {}\n", invalid_number);
-    fmt::print("Encryption weakness: {}\n", smallest_largest_sum(find_sub_array(input, invalid_number).value()));
+    fmt::print("Encryption weakness: {}\n", perf.measure("part 2", [&] {
+        return engines.run("part 2", input.size(), 64,
+                [&] { return smallest_largest_sum(find_sub_array(input, invalid_number).value()); },
+                [&] { return smallest_largest_sum(find_sub_array_sliding(input, invalid_number).value()); });
+    }));
 }
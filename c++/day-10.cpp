@@ -1,13 +1,24 @@
 // https://adventofcode.com/2020/day/10
 
+#include "engine.h"
+#include "flat_hash.h"
+#include "options.h"
+#include "perf_counters.h"
 #include <fmt/os.h>
 #include <algorithm>
+#include <array>
 #include <cassert>
+#include <charconv>
+#include <cstdint>
 #include <cstdlib>
 #include <fstream>
+#include <iostream>
 #include <iterator>
+#include <limits>
 #include <numeric>
-#include <unordered_map>
+#include <optional>
+#include <sstream>
+#include <string>
 #include <utility>
 #include <vector>
 
@@ -28,12 +39,12 @@ counts count_1_and_3_jolt_diffs(std::vector<int> const & diffs)
     return { std::count(diffs.begin(), diffs.end(), 1) , std::count(diffs.begin(), diffs.end(), 3) };
 }
 
-std::size_t count_arrangements(std::vector<int> const & diffs, std::size_t i, std::unordered_map<std::size_t, std::size_t> & results)
+std::size_t count_arrangements(std::vector<int> const & diffs, std::size_t i, flat_hash_map<std::size_t, std::size_t> & results)
 {
     if (i >= diffs.size())
         return 1;
-    if (auto it = results.find(i); it != results.end())
-        return it->second;
+    if (auto cnt = results.find(i))
+        return *cnt;
     std::size_t cnt = 0;
     int diff = 0;
     for (auto j = i; j < diffs.size(); ++j) {
@@ -42,16 +53,352 @@ std::size_t count_arrangements(std::vector<int> const & diffs, std::size_t i, st
             break;
         cnt += count_arrangements(diffs, j + 1, results);
     }
-    results.emplace(i, cnt);
+    results.try_emplace(i, cnt);
     return cnt;
 }
 
 std::size_t count_arrangements(std::vector<int> const & diffs)
 {
-    std::unordered_map<std::size_t, std::size_t> results;
+    flat_hash_map<std::size_t, std::size_t> results(diffs.size());
     return count_arrangements(diffs, 0, results);
 }
 
+// Transfer matrix of the arrangement count DP over a range of joltages. The
+// DP state is the number of ways to reach the current, the previous and the
+// second previous joltage, followed by the number of ways to reach the
+// highest adapter so far.
+using transfer_matrix = std::array<std::array<std::size_t, 4>, 4>;
+
+transfer_matrix operator*(transfer_matrix const & a, transfer_matrix const & b)
+{
+    transfer_matrix c {};
+    for (std::size_t i = 0; i < 4; ++i)
+        for (std::size_t k = 0; k < 4; ++k)
+            for (std::size_t j = 0; j < 4; ++j)
+                c[i][j] += a[i][k] * b[k][j];
+    return c;
+}
+
+// Set of adapters kept in a treap ordered by joltage rating, with the
+// transfer matrix and jolt difference counts of each subtree's range, so
+// that both answers are available after O(log n) expected work per update.
+// Only present ratings have nodes; the joltages between two of them are
+// accounted for when combining ranges.
+struct adapter_set {
+public:
+    adapter_set() = default;
+
+    template <typename ForwardIt>
+    adapter_set(ForwardIt begin, ForwardIt end)
+    {
+        nodes.reserve(static_cast<std::size_t>(std::distance(begin, end)));
+        for (auto it = begin; it != end; ++it)
+            insert(*it);
+    }
+
+    void insert(int rating)
+    {
+        assert(rating >= 1);
+        if (contains(rating))
+            return;
+        auto [lower, higher] = split(root, rating);
+        root = merge(merge(lower, new_node(rating)), higher);
+    }
+
+    void erase(int rating) { root = erase(root, rating); }
+
+    // Applies a batch of (rating, present) updates, with the same result as
+    // applying them in order. The sorted batch is applied in one walk down
+    // the treap, and the new adapters are built into a treap of their own
+    // and united with it, so each node on the way is updated once per batch
+    // rather than once per update.
+    void update(std::vector<std::pair<int, bool>> updates)
+    {
+        std::stable_sort(updates.begin(), updates.end(), [] (auto const & lhs, auto const & rhs) { return lhs.first < rhs.first; });
+        // Only the last update of each rating counts
+        auto last = std::unique(updates.rbegin(), updates.rend(), [] (auto const & lhs, auto const & rhs) { return lhs.first == rhs.first; });
+        updates.erase(updates.begin(), last.base());
+        assert(std::all_of(updates.begin(), updates.end(), [] (auto const & u) { return u.first >= 1; }));
+        std::vector<int> added;
+        root = apply(root, updates.data(), updates.data() + updates.size(), added);
+        root = unite(root, build(added));
+    }
+
+    bool contains(int rating) const
+    {
+        for (auto i = root; i != none; )
+            if (rating == nodes[i].rating)
+                return true;
+            else
+                i = rating < nodes[i].rating ? nodes[i].left : nodes[i].right;
+        return false;
+    }
+
+    std::size_t count_arrangements() const
+    {
+        auto const & all = range_of(root);
+        if (all.n_adapters == 0)
+            return 1;
+        auto m = all.m * gap_matrix(all.lowest);  // from the outlet (0 jolts) to the lowest adapter
+        return m[3][0] + m[3][3];  // initial state: one way to reach the outlet
+    }
+
+    counts count_1_and_3_jolt_diffs() const
+    {
+        auto const & all = range_of(root);
+        if (all.n_adapters == 0)
+            return { 0, 1 };
+        auto c = counts { all.n_diff_1, all.n_diff_3 + 1 };  // the device is always 3 jolts higher
+        if (all.lowest == 1)
+            ++c.first;
+        else if (all.lowest == 3)
+            ++c.second;
+        return c;
+    }
+
+private:
+    // Summary of the adapters in a range of ratings, from its lowest to its
+    // highest adapter
+    struct range {
+        transfer_matrix m;
+        std::size_t n_adapters;
+        int lowest;
+        int highest;
+        std::size_t n_diff_1;
+        std::size_t n_diff_3;
+    };
+
+    struct node {
+        int rating;
+        std::uint32_t priority;
+        std::uint32_t left;
+        std::uint32_t right;
+        range r;
+    };
+
+    static constexpr auto none = std::numeric_limits<std::uint32_t>::max();
+
+    // Matrix of the joltages strictly between two adapters diff jolts apart.
+    // State (a, b, c, h) becomes (0, a, b, h) at every joltage without an
+    // adapter, so after three of them only h is left.
+    static transfer_matrix gap_matrix(int diff)
+    {
+        transfer_matrix m {};
+        for (std::size_t i = 0; i < 4; ++i)
+            m[i][i] = 1;
+        transfer_matrix absent {};
+        absent[1][0] = 1;
+        absent[2][1] = 1;
+        absent[3][3] = 1;
+        for (int i = 1; i < std::min(diff, 4); ++i)
+            m = absent * m;
+        return m;
+    }
+
+    static range leaf(int rating)
+    {
+        // State (a, b, c, h) becomes (a + b + c, a, b, a + b + c) at the adapter's joltage
+        transfer_matrix m {};
+        m[0] = { 1, 1, 1, 0 };
+        m[1][0] = 1;
+        m[2][1] = 1;
+        m[3] = { 1, 1, 1, 0 };
+        return { m, 1, rating, rating, 0, 0 };
+    }
+
+    static range combine(range const & lhs, range const & rhs)
+    {
+        if (lhs.n_adapters == 0)
+            return rhs;
+        if (rhs.n_adapters == 0)
+            return lhs;
+        auto diff = rhs.lowest - lhs.highest;
+        return { rhs.m * gap_matrix(diff) * lhs.m, lhs.n_adapters + rhs.n_adapters, lhs.lowest, rhs.highest,
+                 lhs.n_diff_1 + rhs.n_diff_1 + (diff == 1), lhs.n_diff_3 + rhs.n_diff_3 + (diff == 3) };
+    }
+
+    range const & range_of(std::uint32_t i) const
+    {
+        static range const empty {};
+        return i != none ? nodes[i].r : empty;
+    }
+
+    std::uint32_t new_node(int rating)
+    {
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        node n { rating, seed, none, none, leaf(rating) };
+        if (free_nodes.empty()) {
+            nodes.push_back(n);
+            return static_cast<std::uint32_t>(nodes.size() - 1);
+        }
+        auto i = free_nodes.back();
+        free_nodes.pop_back();
+        nodes[i] = n;
+        return i;
+    }
+
+    void pull(std::uint32_t i)
+    {
+        auto & n = nodes[i];
+        n.r = combine(combine(range_of(n.left), leaf(n.rating)), range_of(n.right));
+    }
+
+    // Splits the treap into the ratings below rating and the others
+    std::pair<std::uint32_t, std::uint32_t> split(std::uint32_t i, int rating)
+    {
+        if (i == none)
+            return { none, none };
+        if (nodes[i].rating < rating) {
+            auto [lower, higher] = split(nodes[i].right, rating);
+            nodes[i].right = lower;
+            pull(i);
+            return { i, higher };
+        }
+        auto [lower, higher] = split(nodes[i].left, rating);
+        nodes[i].left = higher;
+        pull(i);
+        return { lower, i };
+    }
+
+    std::uint32_t erase(std::uint32_t i, int rating)
+    {
+        if (i == none)
+            return none;
+        if (rating == nodes[i].rating) {
+            free_nodes.push_back(i);
+            return merge(nodes[i].left, nodes[i].right);
+        }
+        if (rating < nodes[i].rating)
+            nodes[i].left = erase(nodes[i].left, rating);
+        else
+            nodes[i].right = erase(nodes[i].right, rating);
+        pull(i);
+        return i;
+    }
+
+    // Erases the ratings of the sorted updates [first, last) to be erased,
+    // and appends those to be inserted that are not present to added
+    std::uint32_t apply(std::uint32_t i, std::pair<int, bool> const * first, std::pair<int, bool> const * last, std::vector<int> & added)
+    {
+        if (first == last)
+            return i;
+        if (i == none) {
+            for (auto it = first; it != last; ++it)
+                if (it->second)
+                    added.push_back(it->first);
+            return none;
+        }
+        auto rating = nodes[i].rating;
+        auto mid = std::lower_bound(first, last, rating, [] (auto const & u, int r) { return u.first < r; });
+        auto found = mid != last && mid->first == rating;
+        auto left = apply(nodes[i].left, first, mid, added);
+        auto right = apply(nodes[i].right, found ? mid + 1 : mid, last, added);
+        if (found && !mid->second) {
+            free_nodes.push_back(i);
+            return merge(left, right);
+        }
+        nodes[i].left = left;
+        nodes[i].right = right;
+        pull(i);
+        return i;
+    }
+
+    // Builds a treap of new nodes from sorted ratings in linear time, keeping
+    // the right spine of the treap built so far on a stack
+    std::uint32_t build(std::vector<int> const & ratings)
+    {
+        std::vector<std::uint32_t> spine;
+        for (auto rating: ratings) {
+            auto i = new_node(rating);
+            auto below = none;
+            while (!spine.empty() && nodes[spine.back()].priority < nodes[i].priority) {
+                below = spine.back();
+                spine.pop_back();
+                pull(below);
+            }
+            nodes[i].left = below;
+            if (!spine.empty())
+                nodes[spine.back()].right = i;
+            spine.push_back(i);
+        }
+        for (auto it = spine.rbegin(); it != spine.rend(); ++it)
+            pull(*it);
+        return spine.empty() ? none : spine.front();
+    }
+
+    // Unites two treaps without ratings in common
+    std::uint32_t unite(std::uint32_t lhs, std::uint32_t rhs)
+    {
+        if (lhs == none || rhs == none)
+            return lhs != none ? lhs : rhs;
+        if (nodes[lhs].priority < nodes[rhs].priority)
+            std::swap(lhs, rhs);
+        auto [lower, higher] = split(rhs, nodes[lhs].rating);
+        auto left = unite(nodes[lhs].left, lower);
+        auto right = unite(nodes[lhs].right, higher);
+        nodes[lhs].left = left;
+        nodes[lhs].right = right;
+        pull(lhs);
+        return lhs;
+    }
+
+    // Merges two treaps, with all ratings of lhs below those of rhs
+    std::uint32_t merge(std::uint32_t lhs, std::uint32_t rhs)
+    {
+        if (lhs == none || rhs == none)
+            return lhs != none ? lhs : rhs;
+        if (nodes[lhs].priority > nodes[rhs].priority) {
+            nodes[lhs].right = merge(nodes[lhs].right, rhs);
+            pull(lhs);
+            return lhs;
+        }
+        nodes[rhs].left = merge(lhs, nodes[rhs].left);
+        pull(rhs);
+        return rhs;
+    }
+
+    std::vector<node> nodes;
+    std::vector<std::uint32_t> free_nodes;
+    std::uint32_t root = none;
+    std::uint32_t seed = 2463534242;
+};
+
+// Exits with an error for ratings no adapter can have, which adapter_set
+// does not support
+int valid_rating(int rating)
+{
+    if (rating < 1) {
+        fmt::print(stderr, "Invalid adapter rating {}\n", rating);
+        std::exit(EXIT_FAILURE);
+    }
+    return rating;
+}
+
+// Applies batches of updates read from the stream, one batch per line of
+// "+<rating>" or "-<rating>" items, and prints both answers after each batch
+void apply_update_batches(adapter_set & adapters, std::istream & in)
+{
+    std::string line;
+    while (std::getline(in, line)) {
+        std::istringstream items(line);
+        std::vector<std::pair<int, bool>> updates;
+        for (std::string item; items >> item; ) {
+            int rating = 0;
+            auto [end, ec] = std::from_chars(item.data() + 1, item.data() + item.size(), rating);
+            if ((item[0] != '+' && item[0] != '-') || ec != std::errc {} || end != item.data() + item.size()) {
+                fmt::print(stderr, "Malformed update {}\n", item);
+                std::exit(EXIT_FAILURE);
+            }
+            updates.emplace_back(valid_rating(rating), item[0] == '+');
+        }
+        adapters.update(updates);
+        auto diff_counts = adapters.count_1_and_3_jolt_diffs();
+        fmt::print("{} {}\n", diff_counts.first * diff_counts.second, adapters.count_arrangements());
+    }
+}
+
 void test()
 {
     int const adapter_ratings[] = { 16, 10, 15, 5, 1, 11, 7, 19, 6, 12, 4 };
@@ -65,15 +412,95 @@ void test()
     auto jolt_diffs2 = find_jolt_diffs(std::begin(adapter_ratings2), std::end(adapter_ratings2));
     assert(count_1_and_3_jolt_diffs(jolt_diffs2) == counts(22, 10));
     assert(count_arrangements(jolt_diffs2) == 19208);
+
+    adapter_set adapters(std::begin(adapter_ratings), std::end(adapter_ratings));
+    assert(adapters.count_1_and_3_jolt_diffs() == counts(7, 5));
+    assert(adapters.count_arrangements() == 8);
+    adapter_set adapters2;
+    for (auto rating: adapter_ratings2)
+        adapters2.insert(rating);
+    assert(adapters2.count_1_and_3_jolt_diffs() == counts(22, 10));
+    assert(adapters2.count_arrangements() == 19208);
+
+    // Compare with the static solution after each batch of updates
+    std::vector<std::vector<std::pair<int, bool>>> const batches {
+            { { 49, false }, { 2, false } }, { { 50, true }, { 51, true }, { 2, true } }, { { 1, false } }, { { 90, true } } };
+    std::vector<int> ratings(std::begin(adapter_ratings2), std::end(adapter_ratings2));
+    for (auto const & batch: batches) {
+        adapters2.update(batch);
+        for (auto [rating, present]: batch)
+            if (present)
+                ratings.push_back(rating);
+            else
+                ratings.erase(std::find(ratings.begin(), ratings.end(), rating));
+        auto diffs = find_jolt_diffs(ratings.begin(), ratings.end());
+        assert(adapters2.count_1_and_3_jolt_diffs() == count_1_and_3_jolt_diffs(diffs));
+        assert(adapters2.count_arrangements() == (std::all_of(diffs.begin(), diffs.end(), [] (int d) { return d <= 3; }) ? count_arrangements(diffs) : 0));
+        assert(adapters2.contains(ratings.back()));
+    }
+
+    // Memory only depends on the number of adapters, not on their ratings
+    std::vector<int> sparse_ratings = { 1000000000, 999999999, 999999997, 1 };
+    adapter_set sparse(sparse_ratings.begin(), sparse_ratings.end());
+    auto sparse_diffs = find_jolt_diffs(sparse_ratings.begin(), sparse_ratings.end());
+    assert(sparse.count_1_and_3_jolt_diffs() == count_1_and_3_jolt_diffs(sparse_diffs));
+    assert(sparse.count_arrangements() == 0);
+    sparse.update({ { 1000000000, false }, { 999999999, false }, { 999999997, false }, { 3, true }, { 4, true } });
+    sparse_ratings = { 1, 3, 4 };
+    sparse_diffs = find_jolt_diffs(sparse_ratings.begin(), sparse_ratings.end());
+    assert(sparse.count_1_and_3_jolt_diffs() == count_1_and_3_jolt_diffs(sparse_diffs));
+    assert(sparse.count_arrangements() == count_arrangements(sparse_diffs));
+    assert(!sparse.contains(999999999) && sparse.contains(3));
+    // Later updates of a rating in a batch override earlier ones
+    sparse.update({ { 7, true }, { 3, true }, { 5, true }, { 7, false }, { 4, false }, { 6, true }, { 5, false }, { 5, true } });
+    sparse_ratings = { 1, 3, 5, 6 };
+    sparse_diffs = find_jolt_diffs(sparse_ratings.begin(), sparse_ratings.end());
+    assert(sparse.count_1_and_3_jolt_diffs() == count_1_and_3_jolt_diffs(sparse_diffs));
+    assert(sparse.count_arrangements() == count_arrangements(sparse_diffs));
+    assert(!sparse.contains(4) && !sparse.contains(7) && sparse.contains(5));
 }
 
-int main()
+int main(int argc, char * argv[])
 {
     test();
 
-    std::ifstream in("input/day-10");
-    auto jolt_diffs = find_jolt_diffs(std::istream_iterator<int> { in }, std::istream_iterator<int> {});
-    auto diff_counts = count_1_and_3_jolt_diffs(jolt_diffs);
+    options opts(argc, argv);
+    engine_selector engines(opts);
+    perf_report perf(opts);
+    auto const ratings = perf.measure("parse", [&] {
+        std::ifstream in(std::string { opts.value_or("--input", "input/day-10") });
+        std::vector<int> ratings;
+        std::transform(std::istream_iterator<int> { in }, std::istream_iterator<int> {}, std::back_inserter(ratings), valid_rating);
+        return ratings;
+    });
+    if (opts.has("--updates")) {
+        adapter_set adapters(ratings.begin(), ratings.end());
+        apply_update_batches(adapters, std::cin);
+        return 0;
+    }
+
+    // Each engine prepares its input once, for both parts
+    std::optional<std::vector<int>> jolt_diffs;
+    auto diffs = [&] () -> std::vector<int> const & {
+        if (!jolt_diffs)
+            jolt_diffs = find_jolt_diffs(ratings.begin(), ratings.end());
+        return *jolt_diffs;
+    };
+    std::optional<adapter_set> adapters;
+    auto indexed = [&] () -> adapter_set const & {
+        if (!adapters)
+            adapters.emplace(ratings.begin(), ratings.end());
+        return *adapters;
+    };
+    auto diff_counts = perf.measure("part 1", [&] {
+        return engines.run("part 1", ratings.size(), 1 << 16,
+                [&] { return count_1_and_3_jolt_diffs(diffs()); },
+                [&] { return indexed().count_1_and_3_jolt_diffs(); });
+    });
     fmt::print("1-jolt differences * 3-jolt differences: {}\n", diff_counts.first * diff_counts.second);
-    fmt::print("Distinct arrangements: {}\n", count_arrangements(jolt_diffs));
+    fmt::print("Distinct arrangements: {}\n", perf.measure("part 2", [&] {
+        return engines.run("part 2", ratings.size(), 1 << 16,
+                [&] { return count_arrangements(diffs()); },
+                [&] { return indexed().count_arrangements(); });
+    }));
 }
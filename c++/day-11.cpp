@@ -1,91 +1,72 @@
 // https://adventofcode.com/2020/day/11
 
+#include "engine.h"
+#include "grid_view.h"
+#include "options.h"
+#include "perf_counters.h"
+#include "snapshot.h"
 #include <fmt/os.h>
 #include <algorithm>
+#include <array>
 #include <cassert>
+#include <cstdint>
 #include <cstdlib>
-#include <fstream>
 #include <iterator>
-// #include <numeric>
-// #include <unordered_map>
+#include <string>
+#include <string_view>
+#include <unordered_map>
 #include <utility>
 #include <vector>
 
 struct seat_layout {
 public:
-    template <typename It>
-    seat_layout(It begin, It end)
-    {
-        std::vector<char> row;
-        for (auto it = begin; it != end; ++it) {
-            auto c = *it;
-            if (c == '\n') {
-                rows.push_back(std::move(row));
-                row.clear();
-            }
-            else {
-                assert(c == '#' || c == '.' || c == 'L');
-                row.push_back(c);
-            }
-        }
-        auto not_equal_lengths = [] (auto const & lhs, auto const & rhs) { return lhs.size() != rhs.size(); };
-        assert(std::adjacent_find(rows.begin(), rows.end(), not_equal_lengths) == rows.end());
-        assert(!rows.empty() && !rows[0].empty());
+    explicit seat_layout(grid_view const & grid)
+        : width(grid.n_cols()), height(grid.n_rows())
+    {
+        cells.reserve(width * height);
+        for (std::size_t y = 0; y < height; ++y)
+            cells.append(grid.row(y));
+        assert(std::all_of(cells.begin(), cells.end(), [] (auto c) { return c == '#' || c == '.' || c == 'L'; }));
     }
 
     seat_layout apply_rules() const
     {
         auto next = *this;
-        for (std::size_t y = 0; y < rows[0].size(); ++y)
-            for (std::size_t x = 0; x < rows.size(); ++x)
-                if (rows[y][x] != '.') {
+        for (std::size_t y = 0; y < height; ++y)
+            for (std::size_t x = 0; x < width; ++x)
+                if (at(x, y) != '.') {
                     auto adj = adjacent_occupied(x, y);
-                    if (rows[y][x] == 'L' && adj == 0)
-                        next.rows[y][x] = '#';
-                    else if (rows[y][x] == '#' && adj >= 4)
-                        next.rows[y][x] = 'L';
-
+                    if (at(x, y) == 'L' && adj == 0)
+                        next.cells[y * width + x] = '#';
+                    else if (at(x, y) == '#' && adj >= 4)
+                        next.cells[y * width + x] = 'L';
                 }
         return next;
     }
 
     bool operator==(seat_layout const & other) const
     {
-        return rows == other.rows;
+        return width == other.width && cells == other.cells;
     }
 
     bool operator!=(seat_layout const & other) const
     {
-        return !(rows == other.rows);
+        return !(*this == other);
     }
 
     auto count_occupied() const
     {
-        std::size_t cnt { 0 };
-        for (std::size_t x = 0; x < rows[0].size(); ++x)
-            for (std::size_t y = 0; y < rows.size(); ++y)
-                if (rows[y][x] == '#')
-                    ++cnt;
-        return cnt;
+        return static_cast<std::size_t>(std::count(cells.begin(), cells.end(), '#'));
     }
 
-    void print() const
-    {
-        for (std::size_t y = 0; y < rows.size(); ++y) {
-            for (std::size_t x = 0; x < rows[0].size(); ++x)
-                fmt::print("{}", rows[y][x]);
-            fmt::print("\n");
-        }
-        fmt::print("\n");
-    }
+    std::size_t n_rows() const { return height; }
+    std::size_t n_cols() const { return width; }
+    char at(std::size_t x, std::size_t y) const { return cells[y * width + x]; }
 
-    void print_adj() const
+    void print() const
     {
-        for (std::size_t y = 0; y < rows.size(); ++y) {
-            for (std::size_t x = 0; x < rows[0].size(); ++x)
-                fmt::print("{} ", adjacent_occupied(x, y));
-            fmt::print("\n");
-        }
+        for (std::size_t y = 0; y < height; ++y)
+            fmt::print("{}\n", std::string_view { cells }.substr(y * width, width));
         fmt::print("\n");
     }
 
@@ -93,33 +74,325 @@ private:
     std::size_t adjacent_occupied(size_t x, size_t y) const
     {
         std::size_t cnt = 0;
-        std::pair x_range = { x > 0 ? x - 1 : 0, x < rows[0].size() - 1 ? x + 1 : rows[0].size() - 1 };
-        std::pair y_range = { y > 0 ? y - 1 : 0, y < rows.size() - 1 ? y + 1 : rows.size() - 1 };
-        for (std::size_t i = x_range.first; i < x_range.second; ++i)
-            for (std::size_t j = y_range.first; j < y_range.second; ++j)
-                if (rows[j][i] == '#' && !(x == i && y == j))
+        std::pair x_range = { x > 0 ? x - 1 : 0, x < width - 1 ? x + 1 : width - 1 };
+        std::pair y_range = { y > 0 ? y - 1 : 0, y < height - 1 ? y + 1 : height - 1 };
+        for (std::size_t i = x_range.first; i <= x_range.second; ++i)
+            for (std::size_t j = y_range.first; j <= y_range.second; ++j)
+                if (at(i, j) == '#' && !(x == i && y == j))
                     ++cnt;
         return cnt;
     }
 
-    std::vector<std::vector<char>> rows;
+    std::size_t width;
+    std::size_t height;
+    std::string cells;  // row after row
 };
 
 seat_layout apply_rules_until_stable(seat_layout const & layout)
 {
-    int i = 0;
     auto curr_layout = layout;
-    while (true && i++ < 5) {
-        curr_layout.print();
-        curr_layout.print_adj();
+    while (true) {
         auto next_layout = curr_layout.apply_rules();
         if (next_layout == curr_layout)
             break;
-        curr_layout = next_layout;
+        curr_layout = std::move(next_layout);
     }
     return curr_layout;
 }
 
+// Occupancy of the layout in one flat array with a border of floor around
+// it, so every cell has its 8 neighbours at fixed offsets. Rounds only visit
+// the seats and alternate between two buffers.
+struct seat_grid {
+public:
+    // From a seat_layout, or directly from the input text through a grid_view
+    template <typename Layout>
+    explicit seat_grid(Layout const & layout)
+        : width(layout.n_cols() + 2), occupied((layout.n_rows() + 2) * width), next(occupied.size())
+    {
+        for (std::size_t y = 0; y < layout.n_rows(); ++y)
+            for (std::size_t x = 0; x < layout.n_cols(); ++x)
+                if (auto c = layout.at(x, y); c != '.') {
+                    auto i = (y + 1) * width + x + 1;
+                    seats.push_back(static_cast<std::uint32_t>(i));
+                    occupied[i] = c == '#';
+                }
+    }
+
+    // Applies the rules once, returning false if nothing changed
+    bool apply_rules()
+    {
+        auto const w = static_cast<std::ptrdiff_t>(width);
+        std::ptrdiff_t const offsets[] = { -w - 1, -w, -w + 1, -1, 1, w - 1, w, w + 1 };
+        bool changed = false;
+        for (auto i: seats) {
+            unsigned int adj = 0;
+            for (auto offset: offsets)
+                adj += occupied[i + offset];
+            auto now = occupied[i];
+            next[i] = now ? adj < 4 : adj == 0;
+            changed |= next[i] != now;
+        }
+        std::swap(occupied, next);
+        return changed;
+    }
+
+    std::size_t count_occupied() const
+    {
+        return std::count_if(seats.begin(), seats.end(), [&] (auto i) { return occupied[i] != 0; });
+    }
+
+private:
+    std::size_t width;
+    std::vector<std::uint8_t> occupied;
+    std::vector<std::uint8_t> next;
+    std::vector<std::uint32_t> seats;
+};
+
+std::size_t occupied_when_stable(seat_grid grid)
+{
+    while (grid.apply_rules())
+        ;
+    return grid.count_occupied();
+}
+
+// The layout as a hash-consed quadtree in the manner of HashLife: a node of
+// level k is a 2^k x 2^k square made of four level k - 1 nodes, and equal
+// squares are the same node, so large stretches of floor and repeated seat
+// patterns are stored and advanced only once. The result of advancing the
+// center of a node by one round is memoized in the node. The layout sits in
+// the top left of the root, the rest being floor, and is stable when a round
+// gives the same root. Nodes are never freed as such; instead, whenever the
+// node count has doubled since the last collection, the tree is rebuilt from
+// the live root, dropping unreachable nodes and all memoized rounds.
+struct seat_quadtree {
+public:
+    using node_id = std::uint32_t;
+
+    struct cache_stats {
+        std::size_t hits = 0;
+        std::size_t misses = 0;
+
+        double hit_rate() const { return hits + misses > 0 ? static_cast<double>(hits) / (hits + misses) : 0.0; }
+    };
+
+    explicit seat_quadtree(seat_layout const & layout)
+        : width(layout.n_cols()), height(layout.n_rows())
+    {
+        for (auto c: cell_chars)
+            nodes.push_back({ {}, c == '#' ? 1u : 0u });
+        while (level < 2 || (std::size_t { 1 } << level) < std::max(width, height))
+            ++level;
+        // Up to the level of the root surrounded by floor
+        floors.push_back(floor_cell);
+        while (floors.size() < level + 2)
+            floors.push_back(join(floors.back(), floors.back(), floors.back(), floors.back()));
+        root = build(layout, level, 0, 0);
+        collect_at = std::max(min_collect_at, 2 * nodes.size());
+    }
+
+    // Applies the rules once, returning false if nothing changed
+    bool apply_rules()
+    {
+        // Surround the root with floor, so that the advanced center is the whole root
+        auto f = floors[level - 1];
+        auto [nw, ne, sw, se] = nodes[root].children;
+        auto expanded = join(join(f, f, f, nw), join(f, f, ne, f), join(f, sw, f, f), join(se, f, f, f));
+        auto next = advance(expanded, level + 1);
+        std::swap(root, next);
+        auto changed = root != next;
+        if (nodes.size() >= collect_at)
+            collect_garbage();
+        return changed;
+    }
+
+    // Rebuilds the tree from the root and the floor nodes
+    void collect_garbage()
+    {
+        auto old_nodes = std::move(nodes);
+        nodes.clear();
+        ids.clear();
+        std::vector<node_id> copies(old_nodes.size(), none);
+        auto copy = [&] (auto & self, node_id n) -> node_id {
+            if (n < std::size(cell_chars))
+                return n;
+            if (copies[n] == none) {
+                auto [nw, ne, sw, se] = old_nodes[n].children;
+                copies[n] = join(self(self, nw), self(self, ne), self(self, sw), self(self, se));
+            }
+            return copies[n];
+        };
+        for (auto c: cell_chars)
+            nodes.push_back({ {}, c == '#' ? 1u : 0u });
+        for (auto & f: floors)
+            f = copy(copy, f);
+        root = copy(copy, root);
+        collect_at = std::max(min_collect_at, 2 * nodes.size());
+        ++n_collections;
+    }
+
+    std::size_t n_garbage_collections() const { return n_collections; }
+
+    std::size_t count_occupied() const { return nodes[root].occupied; }
+
+    seat_layout layout() const
+    {
+        std::string text;
+        for (std::size_t y = 0; y < height; ++y) {
+            for (std::size_t x = 0; x < width; ++x)
+                text += cell_chars[cell(root, level, x, y)];
+            text += '\n';
+        }
+        return seat_layout { grid_view { text } };
+    }
+
+    cache_stats const & stats() const { return cache; }
+
+    std::size_t n_nodes() const { return nodes.size(); }
+
+    std::size_t memory_footprint() const
+    {
+        return sizeof(*this) + nodes.capacity() * sizeof(node) + floors.capacity() * sizeof(node_id)
+                + ids.bucket_count() * sizeof(void *) + ids.size() * (sizeof(std::pair<children_t, node_id>) + 2 * sizeof(void *));
+    }
+
+private:
+    using children_t = std::array<node_id, 4>;  // nw, ne, sw, se
+
+    struct node {
+        children_t children;
+        std::uint64_t occupied;
+        node_id next = none;  // center advanced by one round, once computed
+    };
+
+    struct children_hash {
+        std::size_t operator()(children_t const & c) const
+        {
+            std::uint64_t h = 0;
+            for (auto id: c)
+                h = (h ^ id) * 0x9e3779b97f4a7c15u;
+            return h ^ (h >> 32);
+        }
+    };
+
+    static constexpr node_id none = ~node_id { 0 };
+    static constexpr node_id floor_cell = 0;
+    static constexpr node_id empty_seat = 1;
+    static constexpr node_id occupied_seat = 2;
+    static constexpr char cell_chars[] = { '.', 'L', '#' };  // the leaf nodes
+    static constexpr std::size_t min_collect_at = std::size_t { 1 } << 20;
+
+    node_id join(node_id nw, node_id ne, node_id sw, node_id se)
+    {
+        children_t children { nw, ne, sw, se };
+        auto [it, inserted] = ids.try_emplace(children, static_cast<node_id>(nodes.size()));
+        if (inserted)
+            nodes.push_back({ children, nodes[nw].occupied + nodes[ne].occupied + nodes[sw].occupied + nodes[se].occupied });
+        return it->second;
+    }
+
+    node_id child(node_id n, std::size_t quadrant) const { return nodes[n].children[quadrant]; }
+
+    node_id build(seat_layout const & layout, std::size_t lvl, std::size_t x0, std::size_t y0)
+    {
+        if (x0 >= width || y0 >= height)
+            return floors[lvl];
+        if (lvl == 0) {
+            auto c = layout.at(x0, y0);
+            return static_cast<node_id>(std::find(std::begin(cell_chars), std::end(cell_chars), c) - std::begin(cell_chars));
+        }
+        auto half = std::size_t { 1 } << (lvl - 1);
+        return join(build(layout, lvl - 1, x0, y0), build(layout, lvl - 1, x0 + half, y0),
+                build(layout, lvl - 1, x0, y0 + half), build(layout, lvl - 1, x0 + half, y0 + half));
+    }
+
+    node_id cell(node_id n, std::size_t lvl, std::size_t x, std::size_t y) const
+    {
+        for (; lvl > 0; --lvl) {
+            auto half = std::size_t { 1 } << (lvl - 1);
+            n = child(n, (y >= half ? 2 : 0) + (x >= half ? 1 : 0));
+            x %= half;
+            y %= half;
+        }
+        return n;
+    }
+
+    // Center of node n of level lvl >= 2 (half its size) after one round
+    node_id advance(node_id n, std::size_t lvl)
+    {
+        if (nodes[n].next != none) {
+            ++cache.hits;
+            return nodes[n].next;
+        }
+        ++cache.misses;
+        node_id next;
+        if (n == floors[lvl])
+            next = floors[lvl - 1];
+        else if (lvl == 2)
+            next = advance_cells(n);
+        else {
+            // The 4x4 grandchildren, and the centers of the 3x3 overlapping
+            // children made of them after one round
+            node_id g[4][4];
+            for (std::size_t i = 0; i < 4; ++i)
+                for (std::size_t j = 0; j < 4; ++j)
+                    g[i][j] = child(child(n, (i / 2) * 2 + j / 2), (i % 2) * 2 + j % 2);
+            node_id r[3][3];
+            for (std::size_t i = 0; i < 3; ++i)
+                for (std::size_t j = 0; j < 3; ++j)
+                    r[i][j] = advance(join(g[i][j], g[i][j + 1], g[i + 1][j], g[i + 1][j + 1]), lvl - 1);
+            auto center = [&] (std::size_t i, std::size_t j) {
+                return join(child(r[i][j], 3), child(r[i][j + 1], 2), child(r[i + 1][j], 1), child(r[i + 1][j + 1], 0));
+            };
+            next = join(center(0, 0), center(0, 1), center(1, 0), center(1, 1));
+        }
+        nodes[n].next = next;
+        return next;
+    }
+
+    // Center 2x2 cells of a 4x4 node after one round
+    node_id advance_cells(node_id n)
+    {
+        node_id cells[4][4];
+        for (std::size_t y = 0; y < 4; ++y)
+            for (std::size_t x = 0; x < 4; ++x)
+                cells[y][x] = cell(n, 2, x, y);
+        node_id next[4];
+        for (std::size_t y = 1; y < 3; ++y)
+            for (std::size_t x = 1; x < 3; ++x) {
+                auto c = cells[y][x];
+                unsigned int adj = 0;
+                for (std::size_t j = y - 1; j <= y + 1; ++j)
+                    for (std::size_t i = x - 1; i <= x + 1; ++i)
+                        adj += (j != y || i != x) && cells[j][i] == occupied_seat;
+                if (c == empty_seat && adj == 0)
+                    c = occupied_seat;
+                else if (c == occupied_seat && adj >= 4)
+                    c = empty_seat;
+                next[(y - 1) * 2 + x - 1] = c;
+            }
+        return join(next[0], next[1], next[2], next[3]);
+    }
+
+    std::size_t width;
+    std::size_t height;
+    std::size_t level = 0;
+    std::vector<node> nodes;
+    std::unordered_map<children_t, node_id, children_hash> ids;
+    std::vector<node_id> floors;  // the all floor node of each level
+    node_id root;
+    cache_stats cache;
+    std::size_t collect_at = 0;
+    std::size_t n_collections = 0;
+};
+
+std::size_t occupied_when_stable(seat_quadtree & tree)
+{
+    while (tree.apply_rules())
+        ;
+    return tree.count_occupied();
+}
+
 void test()
 {
     const std::string_view input =
@@ -133,16 +406,72 @@ void test()
             "LLLLLLLLLL\n"
             "L.LLLLLL.L\n"
             "L.LLLLL.LL\n";
-    auto layout = seat_layout { input.begin(), input.end() };
-    fmt::print("Occupied seats in stable layout: {}\n", apply_rules_until_stable(layout).count_occupied());
-    assert(apply_rules_until_stable(layout).count_occupied() == 37 + 1);
+    auto layout = seat_layout { grid_view { input } };
+    const std::string_view round2 =
+            "#.LL.L#.##\n"
+            "#LLLLLL.L#\n"
+            "L.L.L..L..\n"
+            "#LLL.LL.L#\n"
+            "#.LL.LL.LL\n"
+            "#.LLLL#.##\n"
+            "..L.L.....\n"
+            "#LLLLLLLL#\n"
+            "#.LLLLLL.L\n"
+            "#.#LLLL.##\n";
+    assert(layout.apply_rules().apply_rules() == (seat_layout { grid_view { round2 } }));
+    assert(apply_rules_until_stable(layout).count_occupied() == 37);
+    assert(occupied_when_stable(seat_grid(layout)) == 37);
+    assert(occupied_when_stable(seat_grid(seat_layout { grid_view { round2 } })) == 37);
+
+    seat_quadtree tree(layout);
+    assert(tree.layout() == layout);
+    auto changed1 = tree.apply_rules();
+    auto changed2 = tree.apply_rules();
+    assert(changed1 && changed2);
+    assert(tree.layout() == (seat_layout { grid_view { round2 } }));
+    auto n_nodes = tree.n_nodes();
+    tree.collect_garbage();
+    assert(tree.n_nodes() < n_nodes && tree.layout() == (seat_layout { grid_view { round2 } }));
+    assert(occupied_when_stable(tree) == 37);
+    assert(tree.layout() == apply_rules_until_stable(layout));
+    auto changed = tree.apply_rules();
+    assert(!changed);
+    assert(tree.stats().hits > 0);
+    // Not a power of two, seats on the border
+    const std::string_view small = "L.L\n###\n";
+    seat_quadtree small_tree(seat_layout { grid_view { small } });
+    assert(occupied_when_stable(small_tree) == apply_rules_until_stable(seat_layout { grid_view { small } }).count_occupied());
 }
 
-int main()
+int main(int argc, char * argv[])
 {
     test();
 
-    //std::ifstream in("input/day-11");
-    //auto layout = seat_layout { std::istreambuf_iterator<char> { in }, std::istreambuf_iterator<char> {} };
-    //fmt::print("Occupied seats in stable layout: {}\n", apply_rules_until_stable(layout).count_occupied());
+    options opts(argc, argv);
+    engine_selector engines(opts);
+    perf_report perf(opts);
+    mapped_file const input(std::string { opts.value_or("--input", "input/day-11") });
+    auto const grid = perf.measure("parse", [&] { return grid_view({ input.data, input.size }); });
+    if (grid.is_empty() || !grid.is_rectangular()) {
+        fmt::print(stderr, "The seat layout is not a non-empty rectangle\n");
+        return EXIT_FAILURE;
+    }
+    // The quadtree is a fast engine, so it is used whatever the input size
+    auto const quadtree = opts.has("--quadtree");
+    if (quadtree && !engines.use_fast(0, 0) && !engines.verifying())
+        fmt::print(stderr, "--quadtree has no effect with --engine=reference\n");
+    fmt::print("Occupied seats in stable layout: {}\n", perf.measure("part 1", [&] {
+        return engines.run("part 1", grid.n_rows() * grid.n_cols(), quadtree ? 0 : 1 << 12,
+                [&] { return apply_rules_until_stable(seat_layout(grid)).count_occupied(); },
+                [&] {
+                    if (!quadtree)
+                        return occupied_when_stable(seat_grid(grid));
+                    seat_quadtree tree(seat_layout { grid });
+                    auto occupied = occupied_when_stable(tree);
+                    fmt::print(stderr, "Quadtree: {} nodes, {} bytes, node cache hit rate {:.1f}% ({} hits, {} misses), {} collections\n",
+                            tree.n_nodes(), tree.memory_footprint(), 100 * tree.stats().hit_rate(), tree.stats().hits, tree.stats().misses,
+                            tree.n_garbage_collections());
+                    return occupied;
+                });
+    }));
 }
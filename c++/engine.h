@@ -0,0 +1,84 @@
+// Selection between the reference implementation of a solution and its
+// optimized engine. "--engine=reference|fast|auto" picks one (auto, the
+// default, uses the fast engine from a per-solution input size on), and
+// "--verify" runs both and aborts on any mismatch.
+
+#pragma once
+
+#include "options.h"
+#include <fmt/format.h>
+#include <fmt/ranges.h>
+#include <cstdio>
+#include <cstdlib>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <type_traits>
+
+struct engine_selector {
+public:
+    enum kind { reference, fast, automatic };
+
+    explicit engine_selector(options const & opts)
+        : verify(opts.has("--verify"))
+    {
+        auto name = opts.value_or("--engine", "auto");
+        if (name == "reference")
+            selected = reference;
+        else if (name == "fast")
+            selected = fast;
+        else if (name == "auto")
+            selected = automatic;
+        else {
+            fmt::print(stderr, "Unknown engine \"{}\" (expected reference, fast or auto)\n", name);
+            std::exit(EXIT_FAILURE);
+        }
+    }
+
+    bool verifying() const { return verify; }
+
+    // True if the fast engine runs for an input of input_size, given the
+    // input size from which it pays off
+    bool use_fast(std::size_t input_size, std::size_t fast_from) const
+    {
+        return selected == fast || (selected == automatic && input_size >= fast_from);
+    }
+
+    // Computes a result with the selected engine, or with both engines when
+    // verifying, in which case a mismatch is reported and aborts the program
+    template <typename Reference, typename Fast>
+    auto run(std::string_view what, std::size_t input_size, std::size_t fast_from, Reference reference_engine, Fast fast_engine)
+    {
+        static_assert(std::is_same_v<decltype(reference_engine()), decltype(fast_engine())>);
+        if (!verify)
+            return use_fast(input_size, fast_from) ? fast_engine() : reference_engine();
+        auto expected = reference_engine();
+        auto actual = fast_engine();
+        if (!(expected == actual)) {
+            fmt::print(stderr, "Engine mismatch in {}: reference engine gives {}, fast engine gives {}\n",
+                    what, describe(expected), describe(actual));
+            std::abort();
+        }
+        fmt::print(stderr, "Verified {}: engines agree\n", what);
+        return actual;
+    }
+
+private:
+    template <typename T>
+    static std::string describe(T const & value)
+    {
+        if constexpr (fmt::is_formattable<T>::value)
+            return fmt::format("{}", value);
+        else
+            return "(unprintable value)";
+    }
+
+    template <typename T>
+    static std::string describe(std::optional<T> const & value)
+    {
+        return value ? describe(*value) : "nothing";
+    }
+
+    kind selected = automatic;
+    bool verify;
+};
@@ -0,0 +1,219 @@
+// Hash map and set with open addressing in flat arrays, in place of the node
+// based std::unordered_map and std::unordered_set on hot paths: inserting
+// allocates nothing once reserved, and probing is linear over adjacent slots.
+// Integer keys are hashed with a bit mixer, as their standard hash is the
+// identity. Erasing shifts the following slots of the probe run back, so
+// there are no tombstones. Pointers to values are invalidated by growing.
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+struct flat_hash {
+    // Finalizer of MurmurHash3
+    static std::uint64_t mix(std::uint64_t h)
+    {
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccd;
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53;
+        h ^= h >> 33;
+        return h;
+    }
+
+    template <typename K>
+    std::uint64_t operator()(K const & key) const
+    {
+        if constexpr (std::is_integral_v<K>)
+            return mix(static_cast<std::uint64_t>(key));
+        else
+            return mix(std::hash<K> {}(key));
+    }
+};
+
+template <typename K, typename V, typename Hash = flat_hash>
+struct flat_hash_map {
+public:
+    flat_hash_map() = default;
+
+    explicit flat_hash_map(std::size_t expected_size)
+    {
+        reserve(expected_size);
+    }
+
+    // Makes room for n elements without growing
+    void reserve(std::size_t n)
+    {
+        std::size_t capacity = 8;
+        while (capacity * max_load_num < n * max_load_den)
+            capacity *= 2;
+        if (capacity > used.size())
+            rehash(capacity);
+    }
+
+    std::size_t size() const { return n_elements; }
+    bool empty() const { return n_elements == 0; }
+    std::size_t capacity() const { return used.size(); }
+
+    void clear()
+    {
+        std::fill(used.begin(), used.end(), std::uint8_t { 0 });
+        n_elements = 0;
+    }
+
+    V const * find(K const & key) const
+    {
+        if (used.empty())
+            return nullptr;
+        for (auto i = home(key);; i = (i + 1) & mask()) {
+            if (!used[i])
+                return nullptr;
+            if (keys[i] == key)
+                return &values[i].value;
+        }
+    }
+
+    V * find(K const & key)
+    {
+        return const_cast<V *>(std::as_const(*this).find(key));
+    }
+
+    bool contains(K const & key) const { return find(key) != nullptr; }
+
+    // Inserts the key with a value made of args, unless it is present; the
+    // value of the key and whether it was inserted
+    template <typename... Args>
+    std::pair<V *, bool> try_emplace(K const & key, Args &&... args)
+    {
+        std::size_t i = 0;
+        if (!used.empty())
+            for (i = home(key); used[i]; i = (i + 1) & mask())
+                if (keys[i] == key)
+                    return { &values[i].value, false };
+        // Only a real insertion grows the table, which moves the free slot
+        if ((n_elements + 1) * max_load_den > used.size() * max_load_num) {
+            rehash(used.empty() ? 8 : 2 * used.size());
+            for (i = home(key); used[i]; i = (i + 1) & mask())
+                ;
+        }
+        used[i] = 1;
+        keys[i] = key;
+        values[i].value = V(std::forward<Args>(args)...);
+        ++n_elements;
+        return { &values[i].value, true };
+    }
+
+    bool erase(K const & key)
+    {
+        if (used.empty())
+            return false;
+        auto i = home(key);
+        for (; used[i]; i = (i + 1) & mask())
+            if (keys[i] == key)
+                break;
+        if (!used[i])
+            return false;
+        // Moves back every following element of the run whose home slot is not
+        // between the hole and itself, which would make it unreachable
+        for (auto j = (i + 1) & mask(); used[j]; j = (j + 1) & mask()) {
+            auto h = home(keys[j]);
+            if (((j - h) & mask()) >= ((j - i) & mask())) {
+                keys[i] = std::move(keys[j]);
+                values[i] = std::move(values[j]);
+                i = j;
+            }
+        }
+        used[i] = 0;
+        --n_elements;
+        return true;
+    }
+
+    // Calls f(key, value) for all elements, in no particular order
+    template <typename F>
+    void for_each(F f) const
+    {
+        for (std::size_t i = 0; i < used.size(); ++i)
+            if (used[i])
+                f(keys[i], values[i].value);
+    }
+
+    std::size_t memory_footprint() const
+    {
+        return sizeof(*this) + used.capacity() + keys.capacity() * sizeof(K) + values.capacity() * sizeof(holder);
+    }
+
+private:
+    // Grows before more than 3/4 of the slots are used
+    static constexpr std::size_t max_load_num = 3;
+    static constexpr std::size_t max_load_den = 4;
+
+    // Keeps std::vector<bool> away
+    struct holder {
+        V value;
+    };
+
+    std::size_t mask() const { return used.size() - 1; }
+    std::size_t home(K const & key) const { return static_cast<std::size_t>(Hash {}(key)) & mask(); }
+
+    void rehash(std::size_t capacity)
+    {
+        auto old_used = std::exchange(used, std::vector<std::uint8_t>(capacity));
+        auto old_keys = std::exchange(keys, std::vector<K>(capacity));
+        auto old_values = std::exchange(values, std::vector<holder>(capacity));
+        for (std::size_t i = 0; i < old_used.size(); ++i)
+            if (old_used[i]) {
+                auto j = home(old_keys[i]);
+                while (used[j])
+                    j = (j + 1) & mask();
+                used[j] = 1;
+                keys[j] = std::move(old_keys[i]);
+                values[j] = std::move(old_values[i]);
+            }
+    }
+
+    std::vector<std::uint8_t> used;
+    std::vector<K> keys;
+    std::vector<holder> values;
+    std::size_t n_elements = 0;
+};
+
+template <typename K, typename Hash = flat_hash>
+struct flat_hash_set {
+public:
+    flat_hash_set() = default;
+
+    explicit flat_hash_set(std::size_t expected_size)
+        : map(expected_size)
+    {
+    }
+
+    void reserve(std::size_t n) { map.reserve(n); }
+    std::size_t size() const { return map.size(); }
+    bool empty() const { return map.empty(); }
+    std::size_t capacity() const { return map.capacity(); }
+    void clear() { map.clear(); }
+    bool contains(K const & key) const { return map.contains(key); }
+
+    // True if the key was not present
+    bool insert(K const & key) { return map.try_emplace(key).second; }
+
+    bool erase(K const & key) { return map.erase(key); }
+
+    template <typename F>
+    void for_each(F f) const
+    {
+        map.for_each([&] (K const & key, auto) { f(key); });
+    }
+
+    std::size_t memory_footprint() const { return map.memory_footprint(); }
+
+private:
+    struct nothing {};
+
+    flat_hash_map<K, nothing, Hash> map;
+};
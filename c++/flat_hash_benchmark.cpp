@@ -0,0 +1,148 @@
+// Compares flat_hash_set and flat_hash_map with std::unordered_set and
+// std::unordered_map on random 64-bit keys, from 10^3 elements to the given
+// maximum size (10^7 by default, 10^8 with --max-size=100000000).
+
+#include "flat_hash.h"
+#include "options.h"
+#include "timing.h"
+#include <fmt/format.h>
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+// Times of one operation on average, in nanoseconds
+struct op_times {
+    double insert;
+    double hit;
+    double miss;
+    double erase;
+};
+
+template <typename Set, typename Insert, typename Contains>
+op_times time_ops(std::vector<std::uint64_t> const & keys, std::vector<std::uint64_t> const & absent, std::size_t repeats,
+        Insert insert, Contains contains)
+{
+    op_times t {};
+    std::size_t n_found = 0;
+    for (std::size_t r = 0; r < repeats; ++r) {
+        Set set;
+        set.reserve(keys.size());
+        auto start = std::chrono::steady_clock::now();
+        for (auto k: keys)
+            insert(set, k);
+        t.insert += seconds_since(start);
+        start = std::chrono::steady_clock::now();
+        for (auto k: keys)
+            n_found += contains(set, k);
+        t.hit += seconds_since(start);
+        start = std::chrono::steady_clock::now();
+        for (auto k: absent)
+            n_found += contains(set, k);
+        t.miss += seconds_since(start);
+        start = std::chrono::steady_clock::now();
+        for (auto k: keys)
+            set.erase(k);
+        t.erase += seconds_since(start);
+        assert(set.empty());
+    }
+    // Checked in release builds too, so the lookups are not optimized away
+    if (n_found != repeats * keys.size()) {
+        fmt::print(stderr, "Wrong lookup results: {} found, {} expected\n", n_found, repeats * keys.size());
+        std::abort();
+    }
+    auto ns_per_op = 1e9 / static_cast<double>(repeats * keys.size());
+    return { t.insert * ns_per_op, t.hit * ns_per_op, t.miss * ns_per_op, t.erase * ns_per_op };
+}
+
+void benchmark(std::size_t max_size)
+{
+    std::mt19937_64 gen;
+    fmt::print("{:>10} {:>36} {:>10} {:>10} {:>10} {:>10}\n", "elements", "container (ns/op)", "insert", "hit", "miss", "erase");
+    for (std::size_t n = 1000; n <= max_size; n *= 10) {
+        // Odd keys are present, even keys absent
+        std::vector<std::uint64_t> keys(n);
+        std::vector<std::uint64_t> absent(n);
+        std::generate(keys.begin(), keys.end(), [&] { return gen() | 1; });
+        std::generate(absent.begin(), absent.end(), [&] { return gen() & ~std::uint64_t { 1 }; });
+        auto repeats = std::max<std::size_t>(1, 1000000 / n);
+        auto print = [&] (std::string_view container, op_times t) {
+            fmt::print("{:>10} {:>36} {:>10.1f} {:>10.1f} {:>10.1f} {:>10.1f}\n", n, container, t.insert, t.hit, t.miss, t.erase);
+        };
+        print("std::unordered_set<uint64_t>", time_ops<std::unordered_set<std::uint64_t>>(keys, absent, repeats,
+                [] (auto & s, auto k) { s.insert(k); }, [] (auto const & s, auto k) { return s.count(k) != 0; }));
+        print("flat_hash_set<uint64_t>", time_ops<flat_hash_set<std::uint64_t>>(keys, absent, repeats,
+                [] (auto & s, auto k) { s.insert(k); }, [] (auto const & s, auto k) { return s.contains(k); }));
+        print("std::unordered_map<uint64_t, uint64_t>", time_ops<std::unordered_map<std::uint64_t, std::uint64_t>>(keys, absent, repeats,
+                [] (auto & m, auto k) { m.emplace(k, k); }, [] (auto const & m, auto k) { return m.count(k) != 0; }));
+        print("flat_hash_map<uint64_t, uint64_t>", time_ops<flat_hash_map<std::uint64_t, std::uint64_t>>(keys, absent, repeats,
+                [] (auto & m, auto k) { m.try_emplace(k, k); }, [] (auto const & m, auto k) { return m.find(k) != nullptr; }));
+    }
+}
+
+void test()
+{
+    // Keys colliding in their home slots, so erasing has to shift runs back
+    struct bad_hash {
+        std::uint64_t operator()(int key) const { return key % 3; }
+    };
+    flat_hash_map<int, int, bad_hash> m;
+    for (int i = 0; i < 100; ++i) {
+        auto emplaced = m.try_emplace(i, 2 * i).second;
+        assert(emplaced);
+    }
+    auto emplaced = m.try_emplace(7, 0).second;
+    assert(!emplaced && *m.find(7) == 14);
+    assert(m.size() == 100 && !m.find(100));
+    for (int i = 0; i < 100; i += 2) {
+        auto erased = m.erase(i);
+        assert(erased);
+    }
+    auto erased = m.erase(0);
+    assert(!erased && m.size() == 50);
+    for (int i = 0; i < 100; ++i)
+        assert((m.find(i) != nullptr) == (i % 2 == 1) && (i % 2 == 0 || *m.find(i) == 2 * i));
+    std::size_t n = 0;
+    m.for_each([&] (int key, int value) { n += value == 2 * key; });
+    assert(n == 50);
+
+    flat_hash_set<std::string> s;
+    auto const first = s.insert("shiny gold");
+    auto const repeated = s.insert("shiny gold");
+    auto const second = s.insert("dark red");
+    assert(first && !repeated && second);
+    assert(s.contains("dark red") && !s.contains("dark blue"));
+    s.clear();
+    assert(s.empty() && !s.contains("dark red"));
+
+    flat_hash_set<std::uint64_t> r(10);
+    auto capacity = r.capacity();
+    for (std::uint64_t i = 0; i < 10; ++i)
+        r.insert(i << 40);
+    assert(r.capacity() == capacity && r.size() == 10);
+
+    // Emplacing a present key at the load limit does not grow the table
+    flat_hash_map<int, int> full;
+    for (int i = 0; full.size() * 4 < full.capacity() * 3 || full.empty(); ++i)
+        full.try_emplace(i, i);
+    auto full_capacity = full.capacity();
+    auto value = full.find(0);
+    auto [existing, inserted] = full.try_emplace(0, 1);
+    assert(!inserted && existing == value && *existing == 0 && full.capacity() == full_capacity);
+}
+
+int main(int argc, char * argv[])
+{
+    test();
+
+    options opts(argc, argv);
+    benchmark(std::stoul(std::string { opts.value_or("--max-size", "10000000") }));
+}
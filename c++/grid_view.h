@@ -0,0 +1,71 @@
+// Rectangular grid of characters read in place from the input text, where
+// row y starts at y * (width + 1), counting the newline. Construction is one
+// scan for the newlines, noting whether all rows have the same length (users
+// check is_rectangular and is_empty before accessing cells), and cell access
+// is plain indexing into the text, which must outlive the view.
+// A bit-packed copy for a cell value is built on first use.
+
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <string_view>
+#include <vector>
+
+struct grid_view {
+public:
+    // One bit per cell, rows padded to whole words
+    struct bit_grid {
+        std::size_t words_per_row = 0;
+        std::vector<std::uint64_t> words;
+
+        bool test(std::size_t x, std::size_t y) const
+        {
+            return (words[y * words_per_row + x / 64] >> (x % 64)) & 1;
+        }
+    };
+
+    explicit grid_view(std::string_view text)
+        : text(text), width(text.find('\n'))
+    {
+        if (width == std::string_view::npos)
+            width = text.size();
+        // Every row is followed by a newline, except possibly the last one
+        for (std::size_t start = 0; start < text.size(); start += width + 1) {
+            auto end = text.find('\n', start);
+            if (end == std::string_view::npos)
+                end = text.size();
+            rectangular &= end - start == width;
+            ++rows;
+        }
+    }
+
+    bool is_rectangular() const { return rectangular; }
+    bool is_empty() const { return rows == 0 || width == 0; }
+    std::size_t n_rows() const { return rows; }
+    std::size_t n_cols() const { return width; }
+    char at(std::size_t x, std::size_t y) const { return text[y * (width + 1) + x]; }
+    std::string_view row(std::size_t y) const { return text.substr(y * (width + 1), width); }
+
+    // Bits set where the cell is c, built on the first call for c (not thread-safe)
+    bit_grid const & packed(char c) const
+    {
+        auto [it, inserted] = packed_cache.try_emplace(c);
+        if (inserted) {
+            auto & bits = it->second;
+            bits.words_per_row = (width + 63) / 64;
+            bits.words.resize(rows * bits.words_per_row);
+            for (std::size_t y = 0; y < rows; ++y)
+                for (std::size_t x = 0; x < width; ++x)
+                    bits.words[y * bits.words_per_row + x / 64] |= std::uint64_t { at(x, y) == c } << (x % 64);
+        }
+        return it->second;
+    }
+
+private:
+    std::string_view text;
+    std::size_t width;
+    std::size_t rows = 0;
+    bool rectangular = true;
+    mutable std::map<char, bit_grid> packed_cache;
+};
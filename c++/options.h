@@ -0,0 +1,39 @@
+// Minimal command line option handling shared by the solutions
+
+#pragma once
+
+#include <algorithm>
+#include <optional>
+#include <string_view>
+#include <vector>
+
+struct options {
+public:
+    options(int argc, char * argv[])
+        : args(argv + 1, argv + argc)
+    {
+    }
+
+    // True if the flag (e.g. "--serve") is given
+    bool has(std::string_view flag) const
+    {
+        return std::find(args.begin(), args.end(), flag) != args.end();
+    }
+
+    // Value of an option given as "<name>=<value>" (e.g. "--input=file")
+    std::optional<std::string_view> value(std::string_view name) const
+    {
+        for (auto arg: args)
+            if (arg.size() > name.size() && arg.substr(0, name.size()) == name && arg[name.size()] == '=')
+                return arg.substr(name.size() + 1);
+        return std::nullopt;
+    }
+
+    std::string_view value_or(std::string_view name, std::string_view default_value) const
+    {
+        return value(name).value_or(default_value);
+    }
+
+private:
+    std::vector<std::string_view> args;
+};
@@ -0,0 +1,423 @@
+// Parser combinators replacing std::regex for reading the puzzle inputs. A
+// grammar is built as a constexpr value from literals, integers, words,
+// sequences (a >> b), alternatives (a | b) and repetitions, and its type is
+// the parser: matching runs as plain scanning code inlined by the compiler.
+// Alternatives, optional parsers and repetitions backtrack to where a failed
+// attempt started, so the second branch of an alternative rescans the text the
+// first one consumed. A failed match reports the byte offset of the furthest
+// position that did not match.
+
+#pragma once
+
+#include "timing.h"
+#include <fmt/format.h>
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <limits>
+#include <optional>
+#include <string_view>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace grammar {
+
+struct cursor {
+    std::string_view text;
+    std::size_t pos = 0;
+    std::size_t furthest_failure = 0;
+
+    constexpr bool at_end() const { return pos == text.size(); }
+
+    // Records a mismatch at offset at
+    constexpr void fail(std::size_t at)
+    {
+        furthest_failure = std::max(furthest_failure, at);
+    }
+};
+
+// Value of parsers which only match text, e.g. literals
+struct ignored {};
+
+// Base of all parsers, enabling the operators below
+struct parser {};
+
+template <typename P>
+constexpr bool is_parser = std::is_base_of_v<parser, P>;
+
+template <typename P>
+using value_of = typename P::value_type;
+
+struct literal : parser {
+    using value_type = ignored;
+
+    constexpr explicit literal(std::string_view text)
+        : text(text)
+    {
+    }
+
+    constexpr std::optional<ignored> operator()(cursor & c) const
+    {
+        for (std::size_t i = 0; i < text.size(); ++i)
+            if (c.pos + i == c.text.size() || c.text[c.pos + i] != text[i]) {
+                c.fail(c.pos + i);
+                return std::nullopt;
+            }
+        c.pos += text.size();
+        return ignored {};
+    }
+
+    std::string_view text;
+};
+
+constexpr literal lit(std::string_view text)
+{
+    return literal { text };
+}
+
+// Matches the end of the input
+struct end_parser : parser {
+    using value_type = ignored;
+
+    constexpr std::optional<ignored> operator()(cursor & c) const
+    {
+        if (!c.at_end()) {
+            c.fail(c.pos);
+            return std::nullopt;
+        }
+        return ignored {};
+    }
+};
+
+inline constexpr end_parser end {};
+
+// Decimal integer with an optional sign, rejected if it overflows T
+template <typename T>
+struct integer_parser : parser {
+    using value_type = T;
+
+    constexpr std::optional<T> operator()(cursor & c) const
+    {
+        auto start = c.pos;
+        bool negative = false;
+        if (c.pos < c.text.size() && (c.text[c.pos] == '+' || c.text[c.pos] == '-')) {
+            negative = c.text[c.pos] == '-';
+            ++c.pos;
+        }
+        if (negative && std::is_unsigned_v<T>) {
+            c.fail(start);
+            return std::nullopt;
+        }
+        // Accumulated negatively for signed types, so the minimum value fits
+        T value = 0;
+        auto digits_start = c.pos;
+        for (; c.pos < c.text.size() && c.text[c.pos] >= '0' && c.text[c.pos] <= '9'; ++c.pos) {
+            T digit = c.text[c.pos] - '0';
+            bool overflow = std::is_unsigned_v<T> || !negative
+                    ? value > (std::numeric_limits<T>::max() - digit) / 10
+                    : value < (std::numeric_limits<T>::min() + digit) / 10;
+            if (overflow) {
+                c.fail(c.pos);
+                return std::nullopt;
+            }
+            value = std::is_unsigned_v<T> || !negative ? value * 10 + digit : value * 10 - digit;
+        }
+        if (c.pos == digits_start) {
+            c.fail(c.pos);
+            return std::nullopt;
+        }
+        return value;
+    }
+};
+
+template <typename T>
+inline constexpr integer_parser<T> integer {};
+
+// Non-empty run of ASCII letters
+struct word_parser : parser {
+    using value_type = std::string_view;
+
+    constexpr std::optional<std::string_view> operator()(cursor & c) const
+    {
+        auto start = c.pos;
+        auto is_letter = [] (char ch) { return (ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z'); };
+        while (c.pos < c.text.size() && is_letter(c.text[c.pos]))
+            ++c.pos;
+        if (c.pos == start) {
+            c.fail(c.pos);
+            return std::nullopt;
+        }
+        return c.text.substr(start, c.pos - start);
+    }
+};
+
+inline constexpr word_parser word {};
+
+template <typename T>
+constexpr auto as_tuple(T value) { return std::tuple<T> { std::move(value) }; }
+
+template <typename... Ts>
+constexpr auto as_tuple(std::tuple<Ts...> values) { return values; }
+
+// Values of a sequence: ignored values are dropped, and the others are
+// collected into one flat tuple, or kept as is if there is only one
+template <typename A, typename B>
+constexpr auto join(A a, B b)
+{
+    if constexpr (std::is_same_v<A, ignored>)
+        return b;
+    else if constexpr (std::is_same_v<B, ignored>)
+        return a;
+    else
+        return std::tuple_cat(as_tuple(std::move(a)), as_tuple(std::move(b)));
+}
+
+template <typename A, typename B>
+struct sequence : parser {
+    using value_type = decltype(join(std::declval<value_of<A>>(), std::declval<value_of<B>>()));
+
+    constexpr sequence(A a, B b)
+        : a(a), b(b)
+    {
+    }
+
+    constexpr std::optional<value_type> operator()(cursor & c) const
+    {
+        auto va = a(c);
+        if (!va)
+            return std::nullopt;
+        auto vb = b(c);
+        if (!vb)
+            return std::nullopt;
+        return join(std::move(*va), std::move(*vb));
+    }
+
+    A a;
+    B b;
+};
+
+// Tries a, and b from the same position if a does not match
+template <typename A, typename B>
+struct alternative : parser {
+    static_assert(std::is_same_v<value_of<A>, value_of<B>>, "alternatives must have the same value type");
+    using value_type = value_of<A>;
+
+    constexpr alternative(A a, B b)
+        : a(a), b(b)
+    {
+    }
+
+    constexpr std::optional<value_type> operator()(cursor & c) const
+    {
+        auto start = c.pos;
+        if (auto v = a(c))
+            return v;
+        c.pos = start;
+        return b(c);
+    }
+
+    A a;
+    B b;
+};
+
+template <typename A, typename B, typename = std::enable_if_t<is_parser<A> && is_parser<B>>>
+constexpr sequence<A, B> operator>>(A a, B b)
+{
+    return { a, b };
+}
+
+template <typename A, typename B, typename = std::enable_if_t<is_parser<A> && is_parser<B>>>
+constexpr alternative<A, B> operator|(A a, B b)
+{
+    return { a, b };
+}
+
+// Applies f to the value of p (unpacking tuples into arguments)
+template <typename P, typename F>
+struct mapped : parser {
+    static constexpr auto apply(F const & f, value_of<P> value)
+    {
+        if constexpr (std::is_same_v<value_of<P>, ignored>)
+            return f();
+        else if constexpr (std::is_invocable_v<F const &, value_of<P>>)
+            return f(std::move(value));
+        else
+            return std::apply(f, std::move(value));
+    }
+
+    using value_type = decltype(apply(std::declval<F const &>(), std::declval<value_of<P>>()));
+
+    constexpr std::optional<value_type> operator()(cursor & c) const
+    {
+        if (auto v = p(c))
+            return apply(f, std::move(*v));
+        return std::nullopt;
+    }
+
+    P p;
+    F f;
+};
+
+template <typename P, typename F>
+constexpr mapped<P, F> map(P p, F f)
+{
+    return { {}, p, f };
+}
+
+// The text matched by p
+template <typename P>
+struct text_parser : parser {
+    using value_type = std::string_view;
+
+    constexpr std::optional<std::string_view> operator()(cursor & c) const
+    {
+        auto start = c.pos;
+        if (!p(c))
+            return std::nullopt;
+        return c.text.substr(start, c.pos - start);
+    }
+
+    P p;
+};
+
+template <typename P>
+constexpr text_parser<P> text(P p)
+{
+    return { {}, p };
+}
+
+// p if it matches, nothing otherwise
+template <typename P>
+struct maybe_parser : parser {
+    using value_type = std::conditional_t<std::is_same_v<value_of<P>, ignored>, ignored, std::optional<value_of<P>>>;
+
+    constexpr std::optional<value_type> operator()(cursor & c) const
+    {
+        auto start = c.pos;
+        auto v = p(c);
+        if (!v)
+            c.pos = start;
+        if constexpr (std::is_same_v<value_of<P>, ignored>)
+            return ignored {};
+        else
+            return value_type { std::move(v) };
+    }
+
+    P p;
+};
+
+template <typename P>
+constexpr maybe_parser<P> maybe(P p)
+{
+    return { {}, p };
+}
+
+// Zero or more p, or p separated by sep, collected into a vector
+template <typename P, typename Sep>
+struct repetition : parser {
+    using value_type = std::vector<value_of<P>>;
+
+    std::optional<value_type> operator()(cursor & c) const
+    {
+        value_type values;
+        auto start = c.pos;
+        auto v = p(c);
+        if (!v) {
+            c.pos = start;
+            return values;
+        }
+        values.push_back(std::move(*v));
+        while (true) {
+            start = c.pos;
+            if constexpr (!std::is_same_v<Sep, ignored>)
+                if (!sep(c)) {
+                    c.pos = start;
+                    return values;
+                }
+            auto element_start = c.pos;
+            auto next = p(c);
+            if (!next) {
+                if constexpr (!std::is_same_v<Sep, ignored>)
+                    return std::nullopt;  // separator without element
+                c.pos = start;
+                return values;
+            }
+            if (c.pos == element_start && std::is_same_v<Sep, ignored>)
+                return values;  // p matched nothing, it would repeat forever
+            values.push_back(std::move(*next));
+        }
+    }
+
+    P p;
+    Sep sep;
+};
+
+template <typename P>
+constexpr repetition<P, ignored> many(P p)
+{
+    return { {}, p, {} };
+}
+
+template <typename P, typename Sep>
+constexpr repetition<P, Sep> sep_by(P p, Sep sep)
+{
+    return { {}, p, sep };
+}
+
+template <typename T>
+struct parse_result {
+    std::optional<T> value;
+    std::size_t error_offset = 0;  // furthest offset that did not match, if there is no value
+};
+
+// Matches p against the whole text
+template <typename P>
+parse_result<value_of<P>> parse(P const & p, std::string_view text)
+{
+    cursor c { text };
+    auto v = p(c);
+    if (v && c.at_end())
+        return { std::move(v), 0 };
+    if (v)
+        c.fail(c.pos);
+    return { std::nullopt, c.furthest_failure };
+}
+
+// Same as parse, exiting with the error offset if the text does not match
+template <typename P>
+value_of<P> parse_or_exit(P const & p, std::string_view text, std::string_view what)
+{
+    auto result = parse(p, text);
+    if (!result.value) {
+        fmt::print(stderr, "Malformed {} at byte offset {}\n", what, result.error_offset);
+        std::exit(EXIT_FAILURE);
+    }
+    return std::move(*result.value);
+}
+
+// Parses input repeats times with the std::regex based parser being replaced
+// and with the parser combinators, and prints the throughput of both
+template <typename Regex, typename Combinators>
+void parse_benchmark(std::string_view input, std::size_t repeats, Regex parse_regex, Combinators parse_combinators)
+{
+    auto start = std::chrono::steady_clock::now();
+    for (std::size_t i = 0; i < repeats; ++i)
+        parse_regex(input);
+    auto regex_time = seconds_since(start);
+    start = std::chrono::steady_clock::now();
+    for (std::size_t i = 0; i < repeats; ++i)
+        parse_combinators(input);
+    auto combinator_time = seconds_since(start);
+    assert(parse_regex(input) == parse_combinators(input));
+
+    fmt::print("Input size: {} bytes, parsed {} times\n", input.size(), repeats);
+    fmt::print("Regular expressions: {:.3e} bytes/s\n", input.size() * repeats / regex_time);
+    fmt::print("Parser combinators: {:.3e} bytes/s\n", input.size() * repeats / combinator_time);
+}
+
+}
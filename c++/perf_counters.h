@@ -0,0 +1,187 @@
+// Hardware performance counters collected around the phases of a solution
+// (parse, part 1, part 2) using perf_event_open. Counters that cannot be
+// opened, e.g. in containers or VMs without PMU access, are reported as
+// unavailable and only the wall-clock time is measured.
+
+#pragma once
+
+#include "options.h"
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <fmt/format.h>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+struct perf_counters {
+public:
+    static constexpr std::size_t n_counters = 4;
+    static constexpr std::array<std::string_view, n_counters> names { "cycles", "instructions", "cache-misses", "branch-misses" };
+
+    using values = std::array<std::optional<std::uint64_t>, n_counters>;
+
+    perf_counters()
+    {
+        constexpr std::array<std::uint64_t, n_counters> configs {
+                PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+                PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES };
+        for (std::size_t i = 0; i < n_counters; ++i) {
+            perf_event_attr attr;
+            std::memset(&attr, 0, sizeof(attr));
+            attr.size = sizeof(attr);
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.config = configs[i];
+            attr.disabled = 1;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            attr.inherit = 1;  // also count threads created later, e.g. by the shared pool
+            fds[i] = static_cast<int>(::syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+        }
+    }
+
+    perf_counters(perf_counters const &) = delete;
+    perf_counters & operator=(perf_counters const &) = delete;
+
+    ~perf_counters()
+    {
+        for (auto fd: fds)
+            if (fd >= 0)
+                ::close(fd);
+    }
+
+    bool any_available() const
+    {
+        for (auto fd: fds)
+            if (fd >= 0)
+                return true;
+        return false;
+    }
+
+    void start()
+    {
+        for (auto fd: fds)
+            if (fd >= 0) {
+                ::ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+                ::ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+            }
+    }
+
+    values stop()
+    {
+        values v;
+        for (std::size_t i = 0; i < n_counters; ++i)
+            if (fds[i] >= 0) {
+                ::ioctl(fds[i], PERF_EVENT_IOC_DISABLE, 0);
+                std::uint64_t count;
+                if (::read(fds[i], &count, sizeof(count)) == sizeof(count))
+                    v[i] = count;
+            }
+        return v;
+    }
+
+private:
+    std::array<int, n_counters> fds;
+};
+
+// Measures named phases when enabled by "--perf" (or "--perf=table") or
+// "--perf=json", and prints the results to stderr on destruction. Counters
+// only cover threads created after they are opened, so construct it before
+// configuring the shared pool.
+struct perf_report {
+public:
+    explicit perf_report(options const & opts)
+        : format(opts.has("--perf") ? std::optional<std::string_view> { "table" } : opts.value("--perf"))
+    {
+        if (format && format != "table" && format != "json") {
+            fmt::print(stderr, "Unknown perf format \"{}\" (expected table or json)\n", *format);
+            std::exit(EXIT_FAILURE);
+        }
+        if (format)
+            counters.emplace();
+    }
+
+    perf_report(perf_report const &) = delete;
+    perf_report & operator=(perf_report const &) = delete;
+
+    ~perf_report()
+    {
+        if (format == "json")
+            print_json();
+        else if (format)
+            print_table();
+    }
+
+    // Runs f, measuring it as the named phase, and returns its result
+    template <typename F>
+    auto measure(std::string_view phase, F f)
+    {
+        if (!counters)
+            return f();
+        auto start = std::chrono::steady_clock::now();
+        counters->start();
+        auto finish = [&] {
+            auto values = counters->stop();
+            phases.push_back({ std::string { phase }, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count(), values });
+        };
+        if constexpr (std::is_void_v<decltype(f())>) {
+            f();
+            finish();
+        }
+        else {
+            auto result = f();
+            finish();
+            return result;
+        }
+    }
+
+private:
+    struct phase_result {
+        std::string name;
+        double seconds;
+        perf_counters::values values;
+    };
+
+    void print_table() const
+    {
+        fmt::print(stderr, "{:<16} {:>12}", "phase", "time (ms)");
+        for (auto name: perf_counters::names)
+            fmt::print(stderr, " {:>15}", name);
+        fmt::print(stderr, "\n");
+        for (auto const & p: phases) {
+            fmt::print(stderr, "{:<16} {:>12.3f}", p.name, p.seconds * 1e3);
+            for (auto const & v: p.values)
+                fmt::print(stderr, " {:>15}", v ? std::to_string(*v) : "n/a");
+            fmt::print(stderr, "\n");
+        }
+        if (!counters->any_available())
+            fmt::print(stderr, "(hardware counters unavailable, e.g. due to perf_event_paranoid or missing PMU access)\n");
+    }
+
+    void print_json() const
+    {
+        fmt::print(stderr, "{{\"counters_available\": {}, \"phases\": [", counters->any_available());
+        for (std::size_t i = 0; i < phases.size(); ++i) {
+            auto const & p = phases[i];
+            fmt::print(stderr, "{}{{\"phase\": \"{}\", \"seconds\": {}", i > 0 ? ", " : "", p.name, p.seconds);
+            for (std::size_t j = 0; j < perf_counters::n_counters; ++j)
+                fmt::print(stderr, ", \"{}\": {}", perf_counters::names[j], p.values[j] ? std::to_string(*p.values[j]) : "null");
+            fmt::print(stderr, "}}");
+        }
+        fmt::print(stderr, "]}}\n");
+    }
+
+    std::optional<std::string_view> format;
+    std::optional<perf_counters> counters;
+    std::vector<phase_result> phases;
+};
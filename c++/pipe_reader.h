@@ -0,0 +1,264 @@
+// Pipelined reading of input that cannot be mapped, e.g. from a pipe. A reader
+// thread fills fixed-size buffers from a file descriptor and hands them to the
+// consuming thread through a bounded lock-free single-producer single-consumer
+// queue; empty buffers go back through a second queue. A side finding its
+// queue empty (or full) spins briefly, then sleeps until the other side makes
+// progress. The consumer receives blocks of whole records, a record cut by a
+// buffer boundary being carried over to the next block, so parsing and
+// solving overlap with reading.
+
+#pragma once
+
+#include "options.h"
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <fmt/format.h>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+template <typename T>
+struct spsc_queue {
+public:
+    explicit spsc_queue(std::size_t capacity)
+        : slots(capacity + 1)
+    {
+    }
+
+    // Called by the producer only; false if the queue is full
+    bool try_push(T value)
+    {
+        auto t = tail.load(std::memory_order_relaxed);
+        auto next = (t + 1) % slots.size();
+        if (next == head.load(std::memory_order_acquire))
+            return false;
+        slots[t] = std::move(value);
+        tail.store(next, std::memory_order_release);
+        return true;
+    }
+
+    // Called by the consumer only; nothing if the queue is empty
+    std::optional<T> try_pop()
+    {
+        auto h = head.load(std::memory_order_relaxed);
+        if (h == tail.load(std::memory_order_acquire))
+            return std::nullopt;
+        auto value = std::move(slots[h]);
+        head.store((h + 1) % slots.size(), std::memory_order_release);
+        return value;
+    }
+
+private:
+    std::vector<T> slots;
+    alignas(64) std::atomic<std::size_t> head { 0 };
+    alignas(64) std::atomic<std::size_t> tail { 0 };
+};
+
+struct pipe_reader {
+public:
+    explicit pipe_reader(int fd, std::size_t buffer_size = std::size_t { 1 } << 16, std::size_t n_buffers = 8)
+        : fd(fd), capacity(buffer_size), filled(n_buffers), empty(n_buffers)
+    {
+        for (std::size_t i = 0; i < n_buffers; ++i) {
+            storage.push_back(std::make_unique<char[]>(buffer_size));
+            empty.try_push({ storage.back().get(), buffer_size });
+        }
+        if (::pipe2(wake_fds, O_CLOEXEC) != 0)
+            wake_fds[0] = wake_fds[1] = -1;
+        reader = std::thread([this] { read_all(); });
+    }
+
+    // Sized by "--read-buffer-size=N" (bytes) and "--read-buffers=N"
+    pipe_reader(int fd, options const & opts)
+        : pipe_reader(fd, std::max<std::size_t>(std::stoul(std::string { opts.value_or("--read-buffer-size", "65536") }), 1),
+                std::max<std::size_t>(std::stoul(std::string { opts.value_or("--read-buffers", "8") }), 1))
+    {
+    }
+
+    pipe_reader(pipe_reader const &) = delete;
+    pipe_reader & operator=(pipe_reader const &) = delete;
+
+    // Stops the reader thread, also when it is blocked waiting for input: it
+    // polls the input together with a wake-up pipe written to here
+    ~pipe_reader()
+    {
+        stopping = true;
+        notify();
+        if (wake_fds[1] >= 0)
+            while (::write(wake_fds[1], "", 1) < 0 && errno == EINTR)
+                ;
+        reader.join();
+        for (auto wake_fd: wake_fds)
+            if (wake_fd >= 0)
+                ::close(wake_fd);
+    }
+
+    // Calls f with consecutive blocks of whole records, in input order. Every
+    // record ends with the separator, except possibly the last one of the input.
+    template <typename F>
+    void for_each_block(std::string_view separator, F f)
+    {
+        std::string carry;
+        while (true) {
+            auto chunk = pop(filled);
+            if (chunk.size == 0)
+                break;
+            std::string_view data { chunk.data, chunk.size };
+            if (!carry.empty()) {
+                // Complete the carried record, possibly with a separator split by the boundary
+                auto end = first_separator_end(carry, data, separator);
+                carry.append(data.substr(0, end == std::string_view::npos ? data.size() : end));
+                if (end == std::string_view::npos) {
+                    recycle(chunk);
+                    continue;
+                }
+                f(std::string_view { carry });
+                carry.clear();
+                data.remove_prefix(end);
+            }
+            auto last = data.rfind(separator);
+            auto whole = last == std::string_view::npos ? 0 : last + separator.size();
+            if (whole > 0)
+                f(data.substr(0, whole));
+            carry.assign(data.substr(whole));
+            recycle(chunk);
+        }
+        if (!carry.empty())
+            f(std::string_view { carry });
+    }
+
+private:
+    struct buffer {
+        char * data = nullptr;
+        std::size_t size = 0;  // capacity in the empty queue, bytes read in the filled one (0 at the end)
+    };
+
+    void read_all()
+    {
+        while (true) {
+            auto b = pop(empty);
+            if (stopping)
+                return;
+            auto capacity = b.size;
+            b.size = 0;
+            // Fill the buffer completely unless the input ends
+            while (b.size < capacity) {
+                if (!wait_readable())
+                    return;
+                auto n = ::read(fd, b.data + b.size, capacity - b.size);
+                if (n < 0 && errno == EINTR)
+                    continue;
+                if (n < 0)
+                    fmt::print(stderr, "Error reading input: {}\n", std::strerror(errno));
+                if (n <= 0)
+                    break;
+                b.size += n;
+            }
+            auto at_end = b.size < capacity;
+            if (b.size > 0)
+                push(filled, b);
+            if (at_end) {
+                push(filled, buffer {});
+                return;
+            }
+        }
+    }
+
+    void recycle(buffer b)
+    {
+        push(empty, { b.data, capacity });
+    }
+
+    // Waits until the input can be read without blocking, false if stopping
+    bool wait_readable()
+    {
+        if (wake_fds[0] < 0)
+            return !stopping;
+        pollfd fds[] = { { fd, POLLIN, 0 }, { wake_fds[0], POLLIN, 0 } };
+        while (::poll(fds, 2, -1) < 0)
+            if (errno != EINTR)
+                return !stopping;
+        return fds[1].revents == 0;
+    }
+
+    buffer pop(spsc_queue<buffer> & queue)
+    {
+        std::optional<buffer> b;
+        if (!retry([&] { return (b = queue.try_pop()).has_value(); }))
+            return {};
+        notify();
+        return *b;
+    }
+
+    void push(spsc_queue<buffer> & queue, buffer b)
+    {
+        if (retry([&] { return queue.try_push(b); }))
+            notify();
+    }
+
+    // Retries attempt until it succeeds (true) or the reader stops (false),
+    // first spinning, then sleeping until notified of progress
+    template <typename Attempt>
+    bool retry(Attempt attempt)
+    {
+        for (int i = 0; i < 64; ++i) {
+            if (attempt())
+                return true;
+            if (stopping)
+                return false;
+        }
+        std::unique_lock lock(mutex);
+        n_waiting.fetch_add(1);
+        std::atomic_thread_fence(std::memory_order_seq_cst);  // pairs with the fence in notify
+        bool done = false;
+        progress.wait(lock, [&] { return (done = attempt()) || stopping; });
+        n_waiting.fetch_sub(1);
+        return done;
+    }
+
+    // Wakes the other side if it sleeps. Either it sees the change made
+    // before the fence when it retries, or this sees it waiting.
+    void notify()
+    {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (n_waiting.load(std::memory_order_relaxed) > 0) {
+            std::lock_guard lock(mutex);
+            progress.notify_all();
+        }
+    }
+
+    // End in data of the first separator completing the carried text, or npos
+    static std::size_t first_separator_end(std::string_view carried, std::string_view data, std::string_view separator)
+    {
+        for (std::size_t split = std::min(separator.size() - 1, carried.size()); split > 0; --split)
+            if (carried.substr(carried.size() - split) == separator.substr(0, split)
+                    && data.substr(0, separator.size() - split) == separator.substr(split))
+                return separator.size() - split;
+        auto pos = data.find(separator);
+        return pos == std::string_view::npos ? pos : pos + separator.size();
+    }
+
+    int fd;
+    std::size_t capacity;
+    std::vector<std::unique_ptr<char[]>> storage;
+    spsc_queue<buffer> filled;
+    spsc_queue<buffer> empty;
+    std::atomic<bool> stopping { false };
+    std::mutex mutex;
+    std::condition_variable progress;
+    std::atomic<int> n_waiting { 0 };
+    int wake_fds[2];
+    std::thread reader;
+};
@@ -0,0 +1,371 @@
+// Binary snapshots of parsed puzzle inputs. A snapshot is stored next to the
+// input as "<input>.snapshot" and holds the parsed input in the form the fast
+// engines work on, so later runs on the same input use it in place where it is
+// mapped, without reading or parsing the input. As in git's index, it is keyed
+// by the input's file status, and the input content is hashed only when the
+// status changed or is too recent to tell a later change apart.
+
+#pragma once
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <array>
+#include <cassert>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// 64-bit hash of bytes taken 8 at a time, each word mixed in by a multiply
+// and a shift, with the finalizer of MurmurHash3 at the end
+inline std::uint64_t content_hash(char const * data, std::size_t size)
+{
+    auto mix = [] (std::uint64_t h) {
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccd;
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53;
+        h ^= h >> 33;
+        return h;
+    };
+    std::uint64_t h = 0xcbf29ce484222325 ^ size;
+    std::size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        std::uint64_t word;
+        std::memcpy(&word, data + i, 8);
+        h = (h ^ word) * 0x9e3779b97f4a7c15;
+        h ^= h >> 32;
+    }
+    std::uint64_t last = 0;
+    if (i < size)
+        std::memcpy(&last, data + i, size - i);
+    return mix(h ^ last);
+}
+
+// File status that changes whenever the file content may have changed
+struct file_stamp {
+    std::uint64_t device = 0;
+    std::uint64_t inode = 0;
+    std::uint64_t size = 0;
+    std::int64_t mtime_ns = 0;
+    std::int64_t ctime_ns = 0;
+
+    static file_stamp of(struct stat const & st)
+    {
+        return { static_cast<std::uint64_t>(st.st_dev), static_cast<std::uint64_t>(st.st_ino), static_cast<std::uint64_t>(st.st_size),
+                 nanoseconds(st.st_mtim), nanoseconds(st.st_ctim) };
+    }
+
+    static std::int64_t nanoseconds(struct timespec const & t)
+    {
+        return std::int64_t { t.tv_sec } * 1000000000 + t.tv_nsec;
+    }
+
+    bool operator==(file_stamp const & other) const
+    {
+        return device == other.device && inode == other.inode && size == other.size
+                && mtime_ns == other.mtime_ns && ctime_ns == other.ctime_ns;
+    }
+};
+
+struct snapshot_header {
+    std::array<char, 8> magic;
+    file_stamp input_stamp;
+    std::uint64_t content_hash;
+    std::uint64_t payload_size;
+    std::uint64_t payload_hash;
+};
+
+constexpr std::array<char, 8> snapshot_magic { 'A', 'o', 'C', 'S', 'n', 'a', 'p', '2' };
+
+// Writes to a fresh temporary file in the same directory, renamed into place,
+// so readers never see a partial snapshot and concurrent writers never share
+// a temporary file
+inline bool save_snapshot_file(std::string const & path, snapshot_header const & header, char const * payload)
+{
+    std::string tmp_path = path + ".XXXXXX";
+    auto fd = ::mkstemp(tmp_path.data());
+    if (fd < 0)
+        return false;
+    auto write_all = [fd] (char const * data, std::size_t size) {
+        while (size > 0) {
+            auto n = ::write(fd, data, size);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                return false;
+            data += n;
+            size -= n;
+        }
+        return true;
+    };
+    bool written = ::fchmod(fd, 0644) == 0
+            && write_all(reinterpret_cast<char const *>(&header), sizeof(header))
+            && write_all(payload, header.payload_size);
+    written = ::close(fd) == 0 && written;
+    if (!written || std::rename(tmp_path.c_str(), path.c_str()) != 0) {
+        ::unlink(tmp_path.c_str());
+        return false;
+    }
+    return true;
+}
+
+// Serializes trivially copyable values, arrays of them and strings. Values are
+// aligned within the payload (which starts 8-byte aligned), so that arrays can
+// be used in place when mapped.
+struct snapshot_writer {
+public:
+    template <typename T>
+    void write(T const & value)
+    {
+        write_array(&value, 1);
+    }
+
+    template <typename T>
+    void write_array(T const * values, std::size_t n)
+    {
+        static_assert(std::is_trivially_copyable_v<T> && alignof(T) <= 8);
+        payload.resize((payload.size() + alignof(T) - 1) / alignof(T) * alignof(T));
+        auto bytes = reinterpret_cast<char const *>(values);
+        payload.insert(payload.end(), bytes, bytes + n * sizeof(T));
+    }
+
+    void write_string(std::string_view s)
+    {
+        write(static_cast<std::uint32_t>(s.size()));
+        write_array(s.data(), s.size());
+    }
+
+    bool save(std::string const & path, file_stamp const & input_stamp, std::uint64_t content_hash) const
+    {
+        snapshot_header header { snapshot_magic, input_stamp, content_hash, payload.size(), ::content_hash(payload.data(), payload.size()) };
+        return save_snapshot_file(path, header, payload.data());
+    }
+
+    std::vector<char> release() { return std::move(payload); }
+
+private:
+    std::vector<char> payload;
+};
+
+// Read-only memory mapping of a whole file. Files that cannot be mapped, e.g.
+// pipes such as /dev/stdin, are read into memory instead.
+struct mapped_file {
+public:
+    explicit mapped_file(std::string const & path)
+    {
+        auto fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            return;
+        struct stat st;
+        auto const known = ::fstat(fd, &st) == 0;
+        if (known && !S_ISREG(st.st_mode))
+            read_all(fd);
+        else if (known && st.st_size > 0) {
+            auto p = ::mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p != MAP_FAILED) {
+                data = static_cast<char const *>(p);
+                size = st.st_size;
+                mapped = true;
+            }
+        }
+        ::close(fd);
+    }
+
+    // Holds bytes already in memory, in place of a file
+    explicit mapped_file(std::vector<char> && bytes)
+        : contents(std::move(bytes))
+    {
+        data = contents.data();
+        size = contents.size();
+    }
+
+    mapped_file(mapped_file && other) noexcept
+        : data(std::exchange(other.data, nullptr)), size(std::exchange(other.size, 0)),
+          mapped(std::exchange(other.mapped, false)), contents(std::move(other.contents))
+    {
+    }
+
+    mapped_file & operator=(mapped_file &&) = delete;
+
+    ~mapped_file()
+    {
+        if (mapped)
+            ::munmap(const_cast<char *>(data), size);
+    }
+
+    char const * data = nullptr;
+    std::size_t size = 0;
+
+private:
+    void read_all(int fd)
+    {
+        contents.resize(std::size_t { 1 } << 16);
+        std::size_t n_read = 0;
+        while (true) {
+            if (n_read == contents.size())
+                contents.resize(2 * contents.size());
+            auto n = ::read(fd, contents.data() + n_read, contents.size() - n_read);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                break;
+            n_read += n;
+        }
+        contents.resize(n_read);
+        data = contents.data();
+        size = n_read;
+    }
+
+    bool mapped = false;
+    std::vector<char> contents;  // what was read, if not mapped
+};
+
+// Reads back what snapshot_writer wrote, in place. Reading beyond the payload
+// marks the reader as failed instead of reading garbage.
+struct snapshot_reader {
+public:
+    snapshot_reader(char const * payload, std::size_t payload_size)
+        : payload(payload), payload_size(payload_size)
+    {
+    }
+
+    template <typename T>
+    T read()
+    {
+        T value {};
+        if (auto p = read_array<T>(1))
+            std::memcpy(&value, p, sizeof(T));
+        return value;
+    }
+
+    template <typename T>
+    T const * read_array(std::size_t n)
+    {
+        static_assert(std::is_trivially_copyable_v<T> && alignof(T) <= 8);
+        auto begin = (pos + alignof(T) - 1) / alignof(T) * alignof(T);
+        if (failed || begin > payload_size || n > (payload_size - begin) / sizeof(T)) {
+            failed = true;
+            return nullptr;
+        }
+        auto p = reinterpret_cast<T const *>(payload + begin);
+        pos = begin + n * sizeof(T);
+        return p;
+    }
+
+    // Reads an element count, which cannot exceed the number of bytes left
+    std::size_t read_size()
+    {
+        auto n = read<std::uint64_t>();
+        if (n > payload_size - pos)
+            failed = true;
+        return failed ? 0 : n;
+    }
+
+    std::string_view read_string()
+    {
+        std::size_t n = read<std::uint32_t>();
+        auto p = read_array<char>(n);
+        return p ? std::string_view { p, n } : std::string_view {};
+    }
+
+    // True if all reads succeeded and the whole payload was consumed
+    bool ok() const { return !failed && pos == payload_size; }
+
+private:
+    char const * payload;
+    std::size_t payload_size;
+    std::size_t pos = 0;
+    bool failed = false;
+};
+
+// The header and payload of a mapped snapshot, if it is intact
+inline std::optional<std::pair<snapshot_header, std::string_view>> read_snapshot(mapped_file const & file)
+{
+    snapshot_header header;
+    if (file.size < sizeof(header))
+        return std::nullopt;
+    std::memcpy(&header, file.data, sizeof(header));
+    std::string_view const payload { file.data + sizeof(header), file.size - sizeof(header) };
+    if (header.magic != snapshot_magic || header.payload_size != payload.size()
+            || header.payload_hash != content_hash(payload.data(), payload.size()))
+        return std::nullopt;
+    return std::pair { header, payload };
+}
+
+// A view of the parsed input, together with the snapshot data it points into
+template <typename View>
+struct loaded_snapshot {
+    mapped_file data;
+    View view;
+};
+
+// Loads the parsed input as a view into the snapshot next to the input file
+// if the snapshot is valid for the input. Otherwise the input is parsed with
+// parse(text), serialized with save(writer, parsed) into a (re)written
+// snapshot, and viewed where it was serialized, so that the solvers get the
+// same view either way. load(reader) returns std::optional<View>, and
+// std::nullopt on malformed data.
+template <typename View, typename Parse, typename Save, typename Load>
+loaded_snapshot<View> parse_with_snapshot(std::string const & input_path, Parse parse, Save save, Load load)
+{
+    // Without an input file to key it next to (e.g. it could not be opened or
+    // is a pipe), the snapshot is only kept in memory. The input is stat-ed
+    // before it is read, so a change while it is read shows in the next stat.
+    struct stat st;
+    auto const keyed = ::stat(input_path.c_str(), &st) == 0 && S_ISREG(st.st_mode) && ::access(input_path.c_str(), R_OK) == 0;
+    auto const stamp = keyed ? file_stamp::of(st) : file_stamp {};
+    auto const snapshot_path = input_path + ".snapshot";
+    std::optional<mapped_file> input;
+    std::optional<std::uint64_t> input_hash;
+    auto hash_input = [&] {
+        if (!input)
+            input.emplace(input_path);
+        if (!input_hash)
+            input_hash = content_hash(input->data, input->size);
+        return *input_hash;
+    };
+
+    if (keyed) {
+        mapped_file file(snapshot_path);
+        struct stat snapshot_st;
+        if (auto snapshot = read_snapshot(file); snapshot && ::stat(snapshot_path.c_str(), &snapshot_st) == 0) {
+            auto & [header, payload] = *snapshot;
+            // An input changed in the same clock tick as the snapshot was
+            // written could keep its status, so its content has to be checked
+            auto const stamped = header.input_stamp == stamp && stamp.ctime_ns < file_stamp::nanoseconds(snapshot_st.st_mtim);
+            if (stamped || header.content_hash == hash_input()) {
+                snapshot_reader reader(payload.data(), payload.size());
+                if (auto view = load(reader); view && reader.ok()) {
+                    // Restamped so that the next run needs no hashing either
+                    if (!stamped) {
+                        header.input_stamp = stamp;
+                        save_snapshot_file(snapshot_path, header, payload.data());
+                    }
+                    return { std::move(file), std::move(*view) };
+                }
+            }
+        }
+    }
+
+    if (!input)
+        input.emplace(input_path);
+    snapshot_writer writer;
+    save(writer, parse(std::string_view { input->data, input->size }));
+    if (keyed)
+        writer.save(snapshot_path, stamp, hash_input());
+    mapped_file data(writer.release());
+    snapshot_reader reader(data.data, data.size);
+    auto view = load(reader);
+    assert(view && reader.ok());
+    return { std::move(data), std::move(*view) };
+}
@@ -0,0 +1,281 @@
+// Work-stealing thread pool shared by the solutions, with parallel_for and
+// parallel_reduce helpers. The pool is sized by "--threads=N" (default: all
+// hardware threads) and "--pool-stats" reports its scaling efficiency on exit.
+
+#pragma once
+
+#include "options.h"
+#include <fmt/format.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+struct thread_pool {
+public:
+    // n_threads includes the thread calling parallel_for, which takes part in the work
+    explicit thread_pool(unsigned int n_threads)
+        : queues(std::max(n_threads, 1U)), stats(queues.size())
+    {
+        for (unsigned int i = 1; i < queues.size(); ++i)
+            workers.emplace_back([this, i] { work(i); });
+    }
+
+    thread_pool(thread_pool const &) = delete;
+    thread_pool & operator=(thread_pool const &) = delete;
+
+    ~thread_pool()
+    {
+        if (report_stats)
+            print_stats();
+        {
+            std::lock_guard lock(sleep_mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto & w: workers)
+            w.join();
+    }
+
+    unsigned int size() const { return static_cast<unsigned int>(queues.size()); }
+
+    void report_stats_on_exit() { report_stats = true; }
+
+    // Calls f(chunk_begin, chunk_end) for chunks of [begin, end) of at least
+    // grain elements, in parallel, and returns when all calls are done. The
+    // first exception thrown by f is rethrown once the other calls are done.
+    template <typename F>
+    void parallel_for(std::size_t begin, std::size_t end, std::size_t grain, F f)
+    {
+        if (begin >= end)
+            return;
+        auto n_chunks = std::min<std::size_t>((end - begin + grain - 1) / std::max<std::size_t>(grain, 1), 4 * size());
+        if (n_chunks <= 1 || size() == 1) {
+            f(begin, end);
+            return;
+        }
+        auto region_start = std::chrono::steady_clock::now();
+        auto chunk_size = (end - begin + n_chunks - 1) / n_chunks;
+        std::atomic<std::size_t> remaining { 0 };
+        std::exception_ptr error;
+        std::mutex error_mutex;
+        for (auto b = begin; b < end; b += chunk_size) {
+            ++remaining;
+            push([&f, &remaining, &error, &error_mutex, b, e = std::min(b + chunk_size, end)] {
+                // Counts the chunk as done however f returns, or the caller waits forever
+                struct done_guard {
+                    std::atomic<std::size_t> & remaining;
+                    ~done_guard() { --remaining; }
+                } done { remaining };
+                try {
+                    f(b, e);
+                } catch (...) {
+                    std::lock_guard lock(error_mutex);
+                    if (!error)
+                        error = std::current_exception();
+                }
+            });
+        }
+        while (remaining > 0)
+            if (!run_one(current_slot()))
+                std::this_thread::yield();
+        if (current_slot() == 0)
+            parallel_time_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - region_start).count();
+        if (error)
+            std::rethrow_exception(error);
+    }
+
+    void print_stats() const
+    {
+        std::uint64_t total_busy_ns = 0;
+        fmt::print(stderr, "{:>6} {:>10} {:>10} {:>12}\n", "thread", "tasks", "steals", "busy (ms)");
+        for (std::size_t i = 0; i < stats.size(); ++i) {
+            total_busy_ns += stats[i].busy_ns;
+            fmt::print(stderr, "{:>6} {:>10} {:>10} {:>12.3f}\n", i, stats[i].tasks.load(), stats[i].steals.load(), stats[i].busy_ns / 1e6);
+        }
+        auto capacity_ns = static_cast<double>(parallel_time_ns) * size();
+        fmt::print(stderr, "Threads: {}, time in parallel regions: {:.3f} ms, scaling efficiency: {:.1f}%\n",
+                size(), parallel_time_ns / 1e6, capacity_ns > 0 ? 100.0 * total_busy_ns / capacity_ns : 100.0);
+    }
+
+private:
+    struct queue {
+        std::mutex mutex;
+        std::deque<std::function<void ()>> tasks;
+    };
+
+    struct worker_stats {
+        std::atomic<std::uint64_t> tasks { 0 };
+        std::atomic<std::uint64_t> steals { 0 };
+        std::atomic<std::uint64_t> busy_ns { 0 };
+    };
+
+    // Index of the calling thread's own queue; 0 for threads outside the pool
+    std::size_t current_slot() const
+    {
+        return worker_pool == this ? worker_slot : 0;
+    }
+
+    void push(std::function<void ()> task)
+    {
+        auto slot = current_slot();
+        if (slot == 0)
+            slot = next_queue++ % queues.size();
+        {
+            std::lock_guard lock(queues[slot].mutex);
+            queues[slot].tasks.push_back(std::move(task));
+        }
+        {
+            std::lock_guard lock(sleep_mutex);
+            ++pending;
+        }
+        wake.notify_one();
+    }
+
+    // Runs a task from the own queue (newest first) or else steals one from
+    // another queue (oldest first). Returns false if there was none.
+    bool run_one(std::size_t slot)
+    {
+        std::function<void ()> task;
+        bool stolen = false;
+        {
+            std::lock_guard lock(queues[slot].mutex);
+            if (!queues[slot].tasks.empty()) {
+                task = std::move(queues[slot].tasks.back());
+                queues[slot].tasks.pop_back();
+            }
+        }
+        for (std::size_t i = 1; !task && i < queues.size(); ++i) {
+            auto & victim = queues[(slot + i) % queues.size()];
+            std::lock_guard lock(victim.mutex);
+            if (!victim.tasks.empty()) {
+                task = std::move(victim.tasks.front());
+                victim.tasks.pop_front();
+                stolen = true;
+            }
+        }
+        if (!task)
+            return false;
+        {
+            std::lock_guard lock(sleep_mutex);
+            --pending;
+        }
+        auto start = std::chrono::steady_clock::now();
+        task();
+        stats[slot].busy_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+        ++stats[slot].tasks;
+        if (stolen)
+            ++stats[slot].steals;
+        return true;
+    }
+
+    void work(std::size_t slot)
+    {
+        worker_pool = this;
+        worker_slot = slot;
+        while (true) {
+            if (run_one(slot))
+                continue;
+            std::unique_lock lock(sleep_mutex);
+            wake.wait(lock, [this] { return stopping || pending > 0; });
+            if (stopping)
+                return;
+        }
+    }
+
+    static inline thread_local thread_pool const * worker_pool = nullptr;
+    static inline thread_local std::size_t worker_slot = 0;
+
+    std::vector<queue> queues;
+    std::vector<worker_stats> stats;
+    std::vector<std::thread> workers;
+    std::atomic<std::size_t> next_queue { 0 };
+    std::mutex sleep_mutex;
+    std::condition_variable wake;
+    std::size_t pending = 0;
+    bool stopping = false;
+    bool report_stats = false;
+    std::atomic<std::uint64_t> parallel_time_ns { 0 };
+};
+
+// Combines map(chunk_begin, chunk_end) over chunks of [begin, end) in chunk
+// order. The first exception thrown by map is rethrown.
+template <typename T, typename Map, typename Combine>
+T parallel_reduce(thread_pool & pool, std::size_t begin, std::size_t end, std::size_t grain, T init, Map map, Combine combine)
+{
+    std::vector<std::pair<std::size_t, T>> results;
+    std::mutex results_mutex;
+    pool.parallel_for(begin, end, grain, [&] (std::size_t b, std::size_t e) {
+        auto r = map(b, e);
+        std::lock_guard lock(results_mutex);
+        results.emplace_back(b, std::move(r));
+    });
+    std::sort(results.begin(), results.end(), [] (auto const & lhs, auto const & rhs) { return lhs.first < rhs.first; });
+    for (auto & [_, r]: results)
+        init = combine(std::move(init), std::move(r));
+    return init;
+}
+
+// Lowers the value to v unless it is already smaller
+inline void fetch_min(std::atomic<std::size_t> & value, std::size_t v)
+{
+    for (auto curr = value.load(); v < curr && !value.compare_exchange_weak(curr, v); )
+        ;
+}
+
+// Splits text into about n_chunks pieces, ending each piece (but the last) right after a separator
+inline std::vector<std::string_view> split_into_chunks(std::string_view text, std::size_t n_chunks, std::string_view separator)
+{
+    std::vector<std::string_view> chunks;
+    auto target_size = text.size() / std::max<std::size_t>(n_chunks, 1) + 1;
+    while (!text.empty()) {
+        auto sep = text.size() > target_size ? text.find(separator, target_size) : std::string_view::npos;
+        auto size = sep == std::string_view::npos ? text.size() : sep + separator.size();
+        chunks.push_back(text.substr(0, size));
+        text.remove_prefix(size);
+    }
+    return chunks;
+}
+
+inline std::unique_ptr<thread_pool> & shared_pool_instance()
+{
+    static std::unique_ptr<thread_pool> pool;
+    return pool;
+}
+
+// (Re)creates the shared pool according to "--threads=N" and "--pool-stats"
+inline void configure_shared_pool(options const & opts)
+{
+    auto n_threads = opts.value("--threads")
+            ? static_cast<unsigned int>(std::stoul(std::string { *opts.value("--threads") }))
+            : std::thread::hardware_concurrency();
+    shared_pool_instance() = std::make_unique<thread_pool>(n_threads);
+    if (opts.has("--pool-stats"))
+        shared_pool_instance()->report_stats_on_exit();
+}
+
+inline thread_pool & shared_pool()
+{
+    auto & pool = shared_pool_instance();
+    if (!pool)
+        pool = std::make_unique<thread_pool>(std::thread::hardware_concurrency());
+    return *pool;
+}
+
+// Pool without workers, running everything on the calling thread
+inline thread_pool & sequential_pool()
+{
+    static thread_pool pool(1);
+    return pool;
+}
@@ -0,0 +1,11 @@
+// Wall-clock timing shared by the benchmark modes
+
+#pragma once
+
+#include <chrono>
+
+// Seconds elapsed since start
+inline double seconds_since(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}